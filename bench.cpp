@@ -0,0 +1,249 @@
+#include "minilog.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+// minilog_bench: measures throughput and per-call latency of minilog::log() and writes the results as JSON
+
+namespace {
+
+struct Scenario {
+  const char* name = "baseline";
+  uint32_t numThreads = 1;
+  bool htmlLog = false;
+  bool console = false;
+  bool forceFlush = false;
+  bool callbacks = false;
+  bool callbackThread = false;
+  uint32_t callstackDepth = 0;
+  bool asyncMode = false;
+  bool threadBuffers = false;
+};
+
+struct Result {
+  Scenario scenario;
+  double messagesPerSecond = 0;
+  uint64_t p50 = 0;
+  uint64_t p99 = 0;
+  uint64_t p999 = 0;
+  uint64_t max = 0;
+};
+
+const char* kLogFileName = "minilog_bench.log";
+
+std::atomic<uint64_t> callbackCounter(0);
+
+void benchCallback(void*, const char* msg) {
+  callbackCounter.fetch_add(msg[0], std::memory_order_relaxed);
+}
+
+void producerProc(const Scenario& s, uint32_t index, uint32_t numMessages, std::atomic<uint32_t>& ready, uint64_t* latencies) {
+  char threadName[32];
+  snprintf(threadName, sizeof(threadName), "Producer%u", index);
+  minilog::threadNameSet(threadName);
+
+  std::vector<std::string> procs(s.callstackDepth);
+  for (uint32_t i = 0; i != s.callstackDepth; i++) {
+    procs[i] = "Proc" + std::to_string(i) + "->";
+    minilog::callstackPushProc(procs[i].c_str());
+  }
+
+  // start all producers at the same time
+  ready.fetch_add(1);
+  while (ready.load() != s.numThreads)
+    std::this_thread::yield();
+
+  for (uint32_t i = 0; i != numMessages; i++) {
+    const auto start = std::chrono::steady_clock::now();
+    minilog::log(minilog::Log, "bench message %u from thread %u: value = %f, tag = %s", i, index, i * 0.5, "some-tag");
+    const auto end = std::chrono::steady_clock::now();
+    latencies[i] = uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+  }
+
+  for (uint32_t i = 0; i != s.callstackDepth; i++)
+    minilog::callstackPopProc();
+}
+
+Result runScenario(const Scenario& s, uint32_t numMessages) {
+  minilog::LogConfig cfg;
+  cfg.logLevelPrintToConsole = s.console ? minilog::Log : minilog::FatalError;
+  cfg.forceFlush = s.forceFlush;
+  cfg.htmlLog = s.htmlLog;
+  cfg.asyncMode = s.asyncMode;
+  cfg.threadBuffers = s.threadBuffers;
+  cfg.callbackThread = s.callbackThread;
+  cfg.writeIntro = false;
+  cfg.writeOutro = false;
+
+  minilog::initialize(kLogFileName, cfg);
+
+  minilog::LogCallback callback;
+  callback.userData = &callbackCounter;
+  for (auto& func : callback.funcs)
+    func = &benchCallback;
+
+  if (s.callbacks)
+    minilog::callbackAdd(callback);
+
+  std::vector<uint64_t> latencies(size_t(s.numThreads) * numMessages);
+  std::vector<std::thread> threads;
+  std::atomic<uint32_t> ready(0);
+
+  const auto start = std::chrono::steady_clock::now();
+
+  for (uint32_t i = 0; i != s.numThreads; i++)
+    threads.emplace_back(producerProc, std::cref(s), i, numMessages, std::ref(ready), latencies.data() + size_t(i) * numMessages);
+
+  for (auto& t : threads)
+    t.join();
+
+  // the async mode and the thread buffers have to write everything out to be comparable
+  minilog::deinitialize();
+
+  const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  if (s.callbacks)
+    minilog::callbackRemove(callback.userData);
+
+  remove(kLogFileName);
+
+  std::sort(latencies.begin(), latencies.end());
+
+  auto percentile = [&latencies](double p) { return latencies[size_t(p * double(latencies.size() - 1))]; };
+
+  Result r;
+  r.scenario = s;
+  r.messagesPerSecond = double(latencies.size()) / seconds;
+  r.p50 = percentile(0.5);
+  r.p99 = percentile(0.99);
+  r.p999 = percentile(0.999);
+  r.max = latencies.back();
+
+  return r;
+}
+
+void writeJSON(FILE* f, const std::vector<Result>& results, uint32_t numMessages) {
+  fprintf(f, "{\n  \"benchmark\": \"minilog_bench\",\n  \"messagesPerThread\": %u,\n  \"results\": [\n", numMessages);
+
+  for (size_t i = 0; i != results.size(); i++) {
+    const Result& r = results[i];
+    const Scenario& s = r.scenario;
+    fprintf(f,
+            "    {\"name\": \"%s\", \"threads\": %u, \"html\": %s, \"console\": %s, \"forceFlush\": %s, \"callbacks\": %s, "
+            "\"callbackThread\": %s, \"callstackDepth\": %u, \"async\": %s, \"threadBuffers\": %s, "
+            "\"messagesPerSecond\": %.0f, \"latencyNs\": {\"p50\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu}}%s\n",
+            s.name, s.numThreads, s.htmlLog ? "true" : "false", s.console ? "true" : "false", s.forceFlush ? "true" : "false",
+            s.callbacks ? "true" : "false", s.callbackThread ? "true" : "false", s.callstackDepth, s.asyncMode ? "true" : "false",
+            s.threadBuffers ? "true" : "false", r.messagesPerSecond, (unsigned long long)r.p50, (unsigned long long)r.p99,
+            (unsigned long long)r.p999, (unsigned long long)r.max,
+            i + 1 != results.size() ? "," : "");
+  }
+
+  fprintf(f, "  ]\n}\n");
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  uint32_t maxThreads = std::max(1u, std::min(8u, std::thread::hardware_concurrency()));
+  uint32_t numMessages = 100000;
+  const char* outFileName = "minilog_bench.json"; // not stdout, the console scenario writes there
+  const char* filter = nullptr;
+
+  for (int i = 1; i != argc; i++) {
+    if (!strcmp(argv[i], "--threads") && i + 1 != argc)
+      maxThreads = std::max(1, atoi(argv[++i]));
+    else if (!strcmp(argv[i], "--messages") && i + 1 != argc)
+      numMessages = std::max(1, atoi(argv[++i]));
+    else if (!strcmp(argv[i], "--out") && i + 1 != argc)
+      outFileName = argv[++i];
+    else if (!strcmp(argv[i], "--filter") && i + 1 != argc)
+      filter = argv[++i];
+    else {
+      printf("Usage: minilog_bench [--threads <max threads>] [--messages <per thread>] [--out <file.json>] [--filter <name>]\n");
+      return 1;
+    }
+  }
+
+  std::vector<Scenario> scenarios;
+
+  // scale the baseline from 1 to N producer threads
+  for (uint32_t n = 1;; n = std::min(2 * n, maxThreads)) {
+    Scenario s;
+    s.numThreads = n;
+    scenarios.push_back(s);
+    if (n == maxThreads)
+      break;
+  }
+
+  // change one thing at a time against the baseline, with 1 and N producer threads
+  for (uint32_t n : {1u, maxThreads}) {
+    Scenario s;
+    s.numThreads = n;
+    Scenario html = s;
+    html.name = "html";
+    html.htmlLog = true;
+    Scenario console = s;
+    console.name = "console";
+    console.console = true;
+    Scenario forceFlush = s;
+    forceFlush.name = "forceFlush";
+    forceFlush.forceFlush = true;
+    Scenario callbacks = s;
+    callbacks.name = "callbacks";
+    callbacks.callbacks = true;
+    Scenario callbackThread = s;
+    callbackThread.name = "callbackThread";
+    callbackThread.callbacks = true;
+    callbackThread.callbackThread = true;
+    Scenario callstack = s;
+    callstack.name = "callstack";
+    callstack.callstackDepth = 32;
+    Scenario async = s;
+    async.name = "async";
+    async.asyncMode = true;
+    Scenario threadBuffers = s;
+    threadBuffers.name = "threadBuffers";
+    threadBuffers.threadBuffers = true;
+    for (const Scenario& v : {html, console, forceFlush, callbacks, callbackThread, callstack, async, threadBuffers})
+      scenarios.push_back(v);
+    if (maxThreads == 1)
+      break;
+  }
+
+  std::vector<Result> results;
+
+  for (const Scenario& s : scenarios) {
+    if (filter && strcmp(filter, s.name))
+      continue;
+    results.push_back(runScenario(s, numMessages));
+    const Result& r = results.back();
+    // the console scenario prints to stdout, keep the progress on stderr
+    fprintf(stderr, "%-12s threads=%-3u %12.0f msg/s   p50=%6llu ns  p99=%8llu ns  p99.9=%8llu ns  max=%10llu ns\n", s.name,
+            s.numThreads, r.messagesPerSecond, (unsigned long long)r.p50, (unsigned long long)r.p99, (unsigned long long)r.p999,
+            (unsigned long long)r.max);
+  }
+
+  FILE* out = fopen(outFileName, "w");
+
+  if (!out) {
+    printf("Cannot open %s\n", outFileName);
+    return 1;
+  }
+
+  writeJSON(out, results, numMessages);
+
+  fclose(out);
+
+  fprintf(stderr, "Results: %s\n", outFileName);
+
+  return 0;
+}
@@ -0,0 +1,40 @@
+#include "minilog.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// minilog_decode: converts a binary log file (LogConfig::binaryLog) into a text, HTML or JSON Lines log
+
+int main(int argc, char** argv) {
+  if (argc < 3) {
+    printf("Usage: minilog_decode <binary log> <output log> [--html | --json] [--no-thread-names] [--console]\n");
+    return 1;
+  }
+
+  minilog::LogConfig cfg = {};
+  cfg.logLevel = minilog::Paranoid;
+  cfg.logLevelPrintToConsole = minilog::FatalError;
+  cfg.forceFlush = false;
+
+  for (int i = 3; i != argc; i++) {
+    if (!strcmp(argv[i], "--html"))
+      cfg.htmlLog = true;
+    else if (!strcmp(argv[i], "--json"))
+      cfg.jsonLog = true;
+    else if (!strcmp(argv[i], "--no-thread-names"))
+      cfg.threadNames = false;
+    else if (!strcmp(argv[i], "--console"))
+      cfg.logLevelPrintToConsole = minilog::Log;
+    else {
+      printf("Unknown option: %s\n", argv[i]);
+      return 1;
+    }
+  }
+
+  if (!minilog::decodeBinaryLog(argv[1], argv[2], cfg)) {
+    printf("Cannot decode %s\n", argv[1]);
+    return 1;
+  }
+
+  return 0;
+}
@@ -131,6 +131,79 @@ void testCustomTimestamp() {
   minilog::deinitialize();
 }
 
+void testAsync() {
+  minilog::initialize("log_async.txt", {.asyncMode = true});
+
+  std::thread t([]() {
+    minilog::threadNameSet("OtherThread");
+    for (int i = 0; i != 100; i++)
+      LLOGL("Message %i from another thread", i);
+  });
+
+  for (int i = 0; i != 100; i++)
+    LLOGL("Message %i from the main thread", i);
+
+  t.join();
+
+  minilog::deinitialize();
+}
+
+void testDeferredFormatting() {
+  minilog::initialize("log_deferred.txt", {.asyncMode = true, .deferredFormatting = true});
+
+  {
+    minilog::CallstackScope scope(FUNC_NAME);
+
+    for (int i = 0; i != 100; i++)
+      LLOGL("x = %d, y = %.3f, name = %s", i, i * 0.5f, "deferred");
+  }
+
+  minilog::deinitialize();
+}
+
+void testBinaryLog() {
+  minilog::initialize("log.bin", {.binaryLog = true});
+
+  {
+    minilog::CallstackScope scope(FUNC_NAME);
+
+    for (int i = 0; i != 100; i++)
+      LLOGL("x = %d, y = %.3f, name = %s", i, i * 0.5f, "binary");
+  }
+
+  minilog::deinitialize();
+
+  // convert to text
+  minilog::decodeBinaryLog("log.bin", "log_decoded.txt", {.logLevelPrintToConsole = minilog::FatalError});
+}
+
+void testFormat() {
+  minilog::initialize("log_format.txt", {});
+
+  const unsigned int i = 32167;
+  const char* name = "logf";
+
+  minilog::logf<minilog::Log>("Hello from {}!", name);
+  minilog::logf<minilog::Warning>("i = {}, pi = {}, flag = {}", i, 3.14159f, true);
+  // the placeholders are counted at compile time with C++17 too
+  MINILOG_LOGF(minilog::Log, "{} placeholders, {} arguments", 2, 2);
+
+  minilog::deinitialize();
+}
+
+void testStructured() {
+  minilog::initialize("log.jsonl", {.jsonLog = true});
+
+  {
+    minilog::CallstackScope scope(FUNC_NAME);
+
+    const char* path = "/index.html";
+    minilog::log(minilog::Log, {{"status", 200}, {"path", path}, {"ms", 1.5}, {"cached", false}}, "request \"%s\" done", path);
+  }
+
+  minilog::deinitialize();
+}
+
 int main() {
   testTXT();
   testHTML();
@@ -139,6 +212,11 @@ int main() {
   testCallstackMacros();
   testCallbacks();
   testCustomTimestamp();
+  testAsync();
+  testDeferredFormatting();
+  testBinaryLog();
+  testFormat();
+  testStructured();
 
   return 0;
 }
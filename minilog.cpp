@@ -31,19 +31,35 @@ SOFTWARE.
 #include "minilog.h"
 
 #include <assert.h>
+#include <ctype.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
 #include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 #if !defined(MINILOG_ENABLE_VA_LIST)
 // forward declaractions
 namespace minilog {
 void log(eLogLevel level, const char* format, va_list args);
 void logRaw(eLogLevel level, const char* format, va_list args);
+void log(Category* category, eLogLevel level, const char* format, va_list args);
+void log(eLogLevel level, std::initializer_list<Field> fields, const char* format, va_list args);
+void log(Category* category, eLogLevel level, std::initializer_list<Field> fields, const char* format, va_list args);
+void logRaw(eLogLevel level, std::initializer_list<Field> fields, const char* format, va_list args);
 } // namespace minilog
 #endif // MINILOG_ENABLE_VA_LIST
 
@@ -60,14 +76,40 @@ void logRaw(eLogLevel level, const char* format, va_list args);
 #  define OS_ANDROID 1
 #endif
 
+#if defined(__linux__) && !defined(__ANDROID__) && defined(__has_include)
+#  if __has_include(<linux/io_uring.h>)
+#    define MINILOG_HAS_IO_URING 1
+#  endif
+#endif
+
 #if OS_WINDOWS
 #  define WIN32_LEAN_AND_MEAN
 #  define NOMINMAX
 #  define NOIME
+#  include <io.h>
+#  include <sys/stat.h>
+#  include <winsock2.h>
+#  include <ws2tcpip.h>
 #  include <windows.h>
 #else
-#  include <sys/time.h>
+#  include <arpa/inet.h>
+#  include <errno.h>
+#  include <fcntl.h>
+#  include <netinet/in.h>
 #  include <pthread.h>
+#  include <sys/mman.h>
+#  include <sys/socket.h>
+#  include <sys/stat.h>
+#  include <sys/uio.h>
+#  include <unistd.h>
+#endif
+
+#if defined(__linux__)
+#  include <sys/syscall.h>
+#endif
+
+#if MINILOG_HAS_IO_URING
+#  include <linux/io_uring.h>
 #endif
 
 #if OS_ANDROID
@@ -80,25 +122,845 @@ void logRaw(eLogLevel level, const char* format, va_list args);
 // clang-format on
 
 static constexpr uint32_t kMaxProcsNesting = 128;
+static constexpr uint32_t kMaxProcsPrefixLength = 4096;
 static constexpr uint32_t kMaxCallbacks = 128;
 
-namespace {
-minilog::LogConfig config = {};
-FILE* logFile = nullptr;
-std::mutex logMutex;
-minilog::LogCallback callbacks[kMaxCallbacks];
-uint32_t callbacksNum = 0;
-} // namespace
+// a message with raw printf arguments, see captureFormatArgs()
+struct CapturedMessage {
+  uint64_t timeStamp = 0;
+  bool raw = false; // logRaw(): no time stamp and callstack
+  const char* callstack = nullptr;
+  uint32_t callstackLength = 0;
+  const char* format = nullptr;
+  const uint8_t* args = nullptr;
+  uint32_t argsSize = 0;
+};
 
-struct ThreadLogContext {
+// a formatted message on its way to the log file, console and callbacks
+struct LogMessage {
+  minilog::eLogLevel level = minilog::Log;
+  bool printToConsole = true; // logRaw() goes to the console only with MINILOG_RAW_OUTPUT
+  const char* threadName = nullptr; // interned, see ThreadNameRegistry
   uint64_t threadId = 0;
-  const char* threadName = nullptr;
+  uint32_t threadIndex = 0; // see ThreadLogContext::threadIndex
+  uint64_t timeStamp = 0; // see getTimeStamp()
+  const char* text = nullptr; // time stamp + callstack + message
+  const char* msg = nullptr; // just the message, this is what callbacks receive
+  const char* callstack = nullptr; // formatted text: the callstack starts here and ends at `msg` (nullptr for raw messages)
+  const char* details = nullptr; // JSON and binary outputs: the category, callstack and fields as data, see MessageDetails
+  const CapturedMessage* captured = nullptr; // binary log: written instead of `text` when available
+  bool raw = false; // logRaw(): not filtered by LogConfig::logLevel
+  bool categorized = false; // log(Category*, ...): already filtered by the category level instead of LogConfig::logLevel
+  bool backtrace = false; // written out of the backtrace ring, not filtered by LogConfig::logLevel
+  bool structured = false; // the message ends with a tab followed by key-value fields, see writeFields()
+};
+
+// key-value fields of a structured message, empty for everything else
+using FieldList = std::initializer_list<minilog::Field>;
+
+// the category, callstack and fields of a message as data, stored right after its text (see writeMessageDetails()): the text
+// has them only in a human-readable form which cannot be split back reliably
+struct MessageDetails {
+  uint32_t size; // the whole block including this header
+  uint32_t msgLength; // the message without the fields (0 if there are no fields)
+  uint32_t callstackSize; // see writeCallstackData()
+  uint32_t numFields; // follow the callstack, see writeFieldsData()
+};
+
+// a piece of data to be written into a log file
+struct FilePart {
+  const void* data;
+  size_t size;
+};
+
+#if MINILOG_HAS_IO_URING
+// FileBackend_IoUring: staging buffers registered with the ring are written with IORING_OP_WRITE_FIXED at explicit offsets,
+// the caller waits only when every buffer is in flight
+class IoUringFile {
+ public:
+  bool open(int fd, uint32_t numBuffers, size_t bufferSize); // false if io_uring is not available
+  void close(); // waits for all writes in flight
+  char* acquire(); // a free buffer to stage into
+  void submitWrite(char* buffer, size_t size);
+  void submitSync(); // fdatasync() after all writes submitted so far
+  void reap(bool wait); // processes completions
+
+ private:
+  struct Buffer {
+    char* data = nullptr;
+    uint64_t offset = 0;
+    size_t size = 0;
+    bool inFlight = false;
+  };
+  struct io_uring_sqe* getSqe();
+  bool enter(uint32_t toSubmit, uint32_t minComplete); // false if the ring cannot be used anymore
+  void abandonRing(); // after enter() failed
+  void writeSync(const char* data, size_t size, uint64_t offset);
+  void complete(uint64_t userData, int32_t result);
+
+  int ringFd_ = -1;
+  int fd_ = -1;
+  void* sqRing_ = nullptr;
+  void* cqRing_ = nullptr;
+  size_t sqRingSize_ = 0;
+  size_t cqRingSize_ = 0;
+  struct io_uring_sqe* sqes_ = nullptr;
+  size_t sqesSize_ = 0;
+  std::atomic<uint32_t>* sqTail_ = nullptr;
+  uint32_t sqMask_ = 0;
+  uint32_t* sqArray_ = nullptr;
+  std::atomic<uint32_t>* cqHead_ = nullptr;
+  std::atomic<uint32_t>* cqTail_ = nullptr;
+  uint32_t cqMask_ = 0;
+  struct io_uring_cqe* cqes_ = nullptr;
+  std::vector<Buffer> buffers_;
+  size_t bufferSize_ = 0;
+  std::vector<char*> retired_; // see abandonRing()
+  bool registered_ = false; // IORING_REGISTER_BUFFERS may fail with a low RLIMIT_MEMLOCK, plain IORING_OP_WRITE is used then
+  bool failed_ = false; // the ring rejected a write, everything else is written with pwrite()
+  bool syncInFlight_ = false;
+  uint32_t numInFlight_ = 0;
+  uint64_t offset_ = 0; // the end of the file, writes never depend on the file position
+};
+#endif // MINILOG_HAS_IO_URING
+
+// all log file output goes through this class, see LogConfig::fileBackend
+class LogFile {
+ public:
+  bool open(const char* fileName, const minilog::LogConfig& cfg);
+  void close();
+  bool isOpen() const {
+    return file_ != nullptr;
+  }
+  void write(const FilePart* parts, uint32_t numParts);
+  void write(const void* data, size_t size) {
+    const FilePart part = {data, size};
+    write(&part, 1);
+  }
+  // applies the flush policy after a complete message has been written
+  void endMessage(minilog::eLogLevel level);
+  // time-based flushing of the batched backend when no messages arrive
+  void flushIfDue();
+  void flush();
+  // LogConfig::rotateMaxFileSize and LogConfig::rotateIntervalSec
+  bool isRotationDue() const;
+  // close the current file, rename it into a segment and start a new one; `footer` (if any) ends the segment. If the file
+  // cannot be renamed it stays the current one and false is returned
+  bool rotate(const char* footer);
+
+ private:
+  bool openFile(bool append);
+  bool growMapping(size_t minSize);
+#if MINILOG_HAS_IO_URING
+  void submitStaging();
+#endif // MINILOG_HAS_IO_URING
+  std::string getSegmentName();
+
+ private:
+  std::string fileName_;
+  minilog::LogConfig cfg_ = {};
+  FILE* file_ = nullptr;
+  uint64_t fileSize_ = 0;
+  time_t openTime_ = 0;
+  minilog::eFileBackend backend_ = minilog::FileBackend_Stdio;
+  bool forceFlush_ = true;
+  // FileBackend_Batched and FileBackend_IoUring
+  char* staging_ = nullptr;
+  size_t stagingSize_ = 0;
+  size_t stagingUsed_ = 0;
+  minilog::eLogLevel flushLevel_ = minilog::Warning;
+  uint64_t flushIntervalTicks_ = 0;
+  uint64_t lastFlushTicks_ = 0;
+#if MINILOG_HAS_IO_URING
+  // FileBackend_IoUring
+  IoUringFile uring_;
+  uint64_t syncIntervalTicks_ = 0;
+  uint64_t lastSyncTicks_ = 0;
+  bool unsynced_ = false; // something was submitted after the last fdatasync()
+#endif // MINILOG_HAS_IO_URING
+  // FileBackend_Mapped
+  char* mapping_ = nullptr;
+  size_t mappingSize_ = 0; // the file is preallocated up to this size
+  size_t mappingChunk_ = 0;
+  size_t cursor_ = 0; // the real length of the file
+  // rotation
+  uint32_t nextSegmentIndex_ = 1;
+  time_t rotateFailedTime_ = 0; // a file which could not be renamed is tried again a second later
+  std::deque<std::string> segments_; // rotated in this session, oldest first
+};
+
+// compresses rotated log segments into .lz4 files and deletes old segments on a background thread
+class LogCompressor {
+ public:
+  void compress(const std::string& fileName) {
+    addTask(fileName, true);
+  }
+  void remove(const std::string& fileName) {
+    addTask(fileName, false);
+  }
+  void stop(); // finishes all queued tasks
+
+ private:
+  struct Task {
+    std::string fileName;
+    bool compress = false;
+  };
+  void addTask(const std::string& fileName, bool compress);
+  void threadProc();
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<Task> tasks_;
+  std::thread thread_;
+  bool stopRequested_ = false;
+};
+
+// FileBackend_Batched/IoUring in the synchronous mode: writes out staged messages when no messages arrive (the async
+// writer and the thread buffer collector do this themselves)
+class FlushTimer {
+ public:
+  void start(uint32_t intervalMs);
+  void stop();
+
+ private:
+  void threadProc();
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::thread thread_;
+  uint32_t intervalMs_ = 0;
+  bool stopRequested_ = false;
+};
+
+// the binary log file (LogConfig::binaryLog), see decodeBinaryLog() for the reader side
+class BinaryLogWriter {
+ public:
+  static constexpr char kMagic[8] = "MLOGBIN";
+  static constexpr uint32_t kVersion = 3; // 2 - Flag_LongArgs, 3 - callstacks and fields as data
+
+  // Chunk_Callstack holds the category and the procs as written by writeCallstackData() (the text before version 3)
+  enum eChunk : uint8_t { Chunk_Format = 'F', Chunk_Callstack = 'C', Chunk_Thread = 'T', Chunk_Message = 'M' };
+  // Flag_LongArgs: MessageRecord::argsSize is 0 and the actual uint32_t size follows the record
+  // Flag_Structured: the "%s" arguments are followed by uint32_t numFields and the fields, see writeFieldsData()
+  enum eFlags : uint8_t {
+    Flag_Raw = 1,
+    Flag_PrintToConsole = 2,
+    Flag_Categorized = 4,
+    Flag_Backtrace = 8,
+    Flag_Structured = 16,
+    Flag_LongArgs = 32
+  };
+
+  struct FileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrderMark; // 0x01020304 as written by the host
+    uint32_t timeStampPrecision; // how to interpret MessageRecord::timeStamp
+    uint32_t reserved;
+  };
+  // a fixed-layout message record, followed by `argsSize` bytes of captured arguments (see Flag_LongArgs)
+  struct MessageRecord {
+    uint64_t timeStamp;
+    uint32_t formatId;
+    uint32_t callstackId;
+    uint32_t threadIndex;
+    uint16_t argsSize;
+    uint8_t level;
+    uint8_t flags;
+  };
+  static_assert(sizeof(MessageRecord) == 24);
+
+  void begin(LogFile& file);
+  void write(LogFile& file, const LogMessage& m);
+
+ private:
+  // definitions are written once, right before the first record referencing them
+  uint32_t internFormat(LogFile& file, const char* format);
+  uint32_t internCallstack(LogFile& file, const char* callstack, uint32_t length);
+  uint32_t internThread(LogFile& file, const LogMessage& m);
+  static void writeString(LogFile& file, eChunk chunk, uint32_t id, const char* str, uint32_t length);
+
+ private:
+  std::unordered_map<const char*, uint32_t> formatIds_;
+  std::vector<std::string> formats_;
+  std::unordered_map<std::string, uint32_t> callstackIds_;
+  std::string callstackKey_;
+  struct ThreadEntry {
+    const char* name; // interned
+    uint64_t id;
+    uint32_t index; // ~0u - not written yet
+  };
+  std::vector<ThreadEntry> threads_; // by LogMessage::threadIndex
+  uint32_t numThreads_ = 0;
+};
+
+// bounded lock-free multi-producer ring of fixed-size message slots (Vyukov's bounded queue)
+class MessageRing {
+ public:
+  static constexpr uint32_t kSlotSize = 1024;
+  static constexpr uint32_t kCacheLineSize = 64;
+
+  struct alignas(kCacheLineSize) Slot {
+    std::atomic<uint64_t> sequence;
+    std::atomic<uint8_t> level; // read by producers applying QueueFull_DropLowPriority
+    bool printToConsole;
+    uint8_t flags; // eFlags
+    uint16_t callstackOffset; // where the callstack starts (after the time stamp)
+    uint32_t msgOffset; // deferred formatting: the end of captured arguments
+    uint32_t threadIndex;
+    uint64_t position;
+    const char* threadName;
+    uint64_t threadId;
+    const char* format; // deferred formatting: the text holds a 0-terminated prefix followed by captured arguments
+    uint64_t timeStamp; // deferred formatting: see getTimeStamp()
+  };
+  static_assert(sizeof(Slot) == kCacheLineSize);
+  // Flag_Spilled: the message did not fit, the text holds a pointer to a heap copy owned by the slot (see deleteSpilledText())
+  // Flag_Details: MessageDetails follow the text (or the captured arguments)
+  enum eFlags : uint8_t {
+    Flag_Raw = 1,
+    Flag_CustomTimeStamp = 2,
+    Flag_Categorized = 4,
+    Flag_Backtrace = 8,
+    Flag_Structured = 16,
+    Flag_Spilled = 32,
+    Flag_Details = 64
+  };
+  static constexpr uint32_t kTextSize = kSlotSize - sizeof(Slot);
+
+  void init(uint32_t capacity, minilog::eQueueFullPolicy policy);
+  void destroy();
+  bool isEmpty() const;
+  // producers: claim a slot, write the message into slotText() and publish it
+  Slot* claim(minilog::eLogLevel level);
+  void publish(Slot* slot) {
+    slot->sequence.store(slot->position + 1, std::memory_order_release);
+  }
+  // consumer: nullptr when there is nothing published
+  Slot* consume();
+  void release(Slot* slot) {
+    slot->sequence.store(slot->position + capacity_, std::memory_order_release);
+  }
+  static char* slotText(Slot* slot) {
+    return reinterpret_cast<char*>(slot) + sizeof(Slot);
+  }
+  // slots and ThreadBuffer records
+  template <typename T>
+  static void deleteSpilledText(const T* q, const char* text) {
+    if (!(q->flags & Flag_Spilled))
+      return;
+    char* spilled;
+    memcpy(&spilled, text, sizeof(spilled));
+    delete[] spilled;
+  }
+  uint64_t getNumDropped() const {
+    return numDropped_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  Slot* getSlot(uint64_t pos) const {
+    return reinterpret_cast<Slot*>(memory_ + (pos & mask_) * kSlotSize);
+  }
+  Slot* tryClaim();
+  bool dropOldest(bool lowPriorityOnly);
+
+ private:
+  alignas(kCacheLineSize) std::atomic<uint64_t> head_ = 0;
+  alignas(kCacheLineSize) std::atomic<uint64_t> tail_ = 0;
+  alignas(kCacheLineSize) std::atomic<uint64_t> numDropped_ = 0;
+  uint8_t* memory_ = nullptr;
+  uint64_t capacity_ = 0;
+  uint64_t mask_ = 0;
+  minilog::eQueueFullPolicy policy_ = minilog::QueueFull_Block;
+};
+
+// the async mode (LogConfig::asyncMode): producers format into the ring, the writer thread drains it
+class AsyncQueue {
+ public:
+  void start(uint32_t capacity, minilog::eQueueFullPolicy policy);
+  void stop(); // drains all pending messages and joins the writer thread
+  bool isRunning() const {
+    return writerThread_.joinable();
+  }
+  MessageRing::Slot* claim(minilog::eLogLevel level) {
+    return ring_.claim(level);
+  }
+  void publish(MessageRing::Slot* slot);
+
+ private:
+  void writerThreadProc();
+  void reportDroppedMessages();
+
+  MessageRing ring_;
+  std::mutex mutex_; // only used to put the writer thread to sleep
+  std::condition_variable cv_;
+  std::atomic<bool> writerSleeping_ = false;
+  std::atomic<bool> stopRequested_ = false;
+  uint64_t numDroppedReported_ = 0;
+  std::thread writerThread_;
+};
+
+struct ThreadLogContext;
+struct OverflowArena;
+
+// LogConfig::threadBuffers: a single-producer single-consumer byte ring owned by one thread, drained by the collector thread
+class ThreadBuffer {
+ public:
+  // the same fields as MessageRing::Slot, followed by the text
+  struct Record {
+    uint32_t size; // the whole record, 0 - the rest of the ring is unused, continue at the beginning
+    minilog::eLogLevel level;
+    bool printToConsole;
+    uint8_t flags; // MessageRing::eFlags
+    uint16_t callstackOffset;
+    uint32_t msgOffset;
+    uint32_t threadIndex;
+    const char* threadName;
+    uint64_t threadId;
+    const char* format;
+    uint64_t timeStamp;
+  };
+  static constexpr uint32_t kMaxTextSize = 8192;
+  static constexpr uint32_t kMaxRecordSize = sizeof(Record) + kMaxTextSize;
+
+  explicit ThreadBuffer(uint32_t size);
+  ~ThreadBuffer();
+  static char* recordText(Record* r) {
+    return reinterpret_cast<char*>(r + 1);
+  }
+  // producer
+  Record* beginWrite(); // nullptr if there is no room for a record of kMaxRecordSize
+  void endWrite(Record* r, uint32_t textSize);
+  bool isHalfFull() const {
+    return head_.load(std::memory_order_relaxed) - cachedTail_ > size_ / 2;
+  }
+  // the same with the current position of the consumer
+  bool isHalfFullNow() {
+    if (!isHalfFull())
+      return false;
+    cachedTail_ = tail_.load(std::memory_order_acquire);
+    return isHalfFull();
+  }
+  // consumer
+  void snapshot(); // peek() returns only records written before this call
+  Record* peek();
+  void pop(Record* r);
+  bool isEmpty() const {
+    return tail_.load(std::memory_order_relaxed) == head_.load(std::memory_order_acquire);
+  }
+
+  std::atomic<bool> closed = false; // the thread has exited, the collector deletes the buffer once it is empty
+  std::atomic<uint64_t> numDropped = 0;
+  uint64_t numDroppedReported = 0;
+
+ private:
+  char* data_ = nullptr;
+  uint32_t size_ = 0; // a power of two
+  alignas(64) std::atomic<uint64_t> head_ = 0; // written by the producer
+  uint64_t cachedTail_ = 0;
+  uint64_t pendingHead_ = 0; // beginWrite() skipped the end of the ring
+  alignas(64) std::atomic<uint64_t> tail_ = 0; // written by the consumer
+  uint64_t limit_ = 0;
+};
+
+// LogConfig::threadBuffers: the collector thread merges all thread buffers by time stamp and writes them out
+class ThreadBufferCollector {
+ public:
+  void start(uint32_t bufferSize, uint32_t flushIntervalMs, minilog::eQueueFullPolicy policy);
+  void stop(); // drains all buffers and joins the collector thread
+  bool isRunning() const {
+    return thread_.joinable();
+  }
+  ThreadBuffer* getBuffer(ThreadLogContext* ctx); // the buffer of the calling thread, created on first use
+  // applies LogConfig::asyncQueueFullPolicy, nullptr if the message is dropped
+  ThreadBuffer::Record* beginWrite(ThreadBuffer* buffer, minilog::eLogLevel level);
+  void wake();
+  void wakeIfSleeping() {
+    if (sleeping_.load(std::memory_order_relaxed))
+      wake();
+  }
+  void close(ThreadBuffer* buffer, uint32_t generation); // the owning thread has exited
+
+ private:
+  void threadProc();
+  void collect(OverflowArena& overflow); // logMutex must be locked
+
+  std::mutex mutex_; // guards buffers_, also used to put the collector thread to sleep
+  std::condition_variable cv_;
+  std::vector<ThreadBuffer*> buffers_;
+  std::vector<ThreadBuffer*> collecting_; // collector thread only
+  uint32_t bufferSize_ = 0;
+  uint32_t flushIntervalMs_ = 0;
+  minilog::eQueueFullPolicy policy_ = minilog::QueueFull_Block;
+  std::atomic<bool> sleeping_ = false;
+  std::atomic<bool> stopRequested_ = false;
+  std::atomic<uint32_t> generation_ = 1; // stop() deletes all buffers, threads notice it and get new ones
+  std::thread thread_;
+};
+
+// callbacks: loggers read an immutable snapshot without locking, callbackAdd()/callbackRemove() publish a new one (RCU-style)
+class CallbackRegistry {
+ public:
+  ~CallbackRegistry();
+  bool add(const minilog::LogCallback& cb);
+  void remove(void* userData);
+  void invoke(minilog::eLogLevel level, const char* msg);
+  bool has(minilog::eLogLevel level);
+
+ private:
+  struct Snapshot {
+    uint32_t num = 0;
+    minilog::LogCallback callbacks[kMaxCallbacks];
+  };
+  struct Retired {
+    Snapshot* snapshot = nullptr;
+    bool drained[2] = {}; // a reader counter was seen at zero after this snapshot had been replaced
+  };
+  // readers
+  const Snapshot* enter(uint32_t& counter);
+  void leave(uint32_t counter) {
+    readers_[counter].fetch_sub(1);
+  }
+  // writers
+  void retire(Snapshot* snapshot); // under writeMutex_, deletes retired snapshots no reader can see anymore
+  void synchronize(); // waits for all readers which could have seen replaced snapshots
+
+ private:
+  std::atomic<Snapshot*> current_ = nullptr; // nullptr when there are no callbacks
+  std::atomic<uint32_t> epoch_ = 0; // new readers use readers_[epoch_ & 1]
+  alignas(64) std::atomic<uint32_t> readers_[2] = {};
+  std::mutex writeMutex_;
+  std::vector<Retired> retired_;
+};
+
+// LogConfig::callbackThread: messages are copied into a ring and callbacks are invoked on a dispatcher thread
+class CallbackDispatcher {
+ public:
+  void start(uint32_t capacity, minilog::eQueueFullPolicy policy);
+  void stop(); // invokes callbacks for all pending messages and joins the dispatcher thread
+  bool isRunning() const {
+    return thread_.joinable();
+  }
+  void post(minilog::eLogLevel level, const char* msg);
+
+ private:
+  void threadProc();
+
+  MessageRing ring_;
+  std::mutex mutex_; // only used to put the dispatcher thread to sleep
+  std::condition_variable cv_;
+  std::atomic<bool> sleeping_ = false;
+  std::atomic<bool> stopRequested_ = false;
+  uint64_t numDroppedReported_ = 0;
+  std::thread thread_;
+};
+
+// console output: every line is written with its color escapes by a single write(), runs of lines are coalesced;
+// with LogConfig::consoleThread a slow terminal stalls only the console thread
+class ConsoleWriter {
+ public:
+  void start(const minilog::LogConfig& cfg); // checks whether stdout is a terminal
+  void stop(); // writes out everything queued and joins the console thread
+  bool isRunning() const {
+    return thread_.joinable();
+  }
+  void print(const LogMessage& m); // logMutex must be locked
+  // lines printed between beginBatch() and endBatch() are written at once, logMutex must be locked
+  void beginBatch() {
+    batchDepth_++;
+  }
+  void endBatch() {
+    if (!--batchDepth_)
+      flush();
+  }
+
+ private:
+  static constexpr size_t kStagingSize = 64 * 1024;
+  void append(const char* data, size_t size);
+  void flush();
+  void threadProc();
+  static void writeOut(const char* data, size_t size);
+
+  char staging_[kStagingSize]; // guarded by logMutex
+  size_t stagingSize_ = 0;
+  uint32_t batchDepth_ = 0;
+  bool colors_ = true;
+  uint64_t numDropped_ = 0; // guarded by logMutex
+  // LogConfig::consoleThread
+  std::thread thread_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::vector<char> queue_; // guarded by mutex_, written out by the console thread
+  std::atomic<size_t> queueSize_ = 0; // lock-free estimate for print()
+  size_t queueCapacity_ = 0;
+  bool stopRequested_ = false; // guarded by mutex_
+};
+
+// an additional output added with minilog::sinkAdd()
+class Sink {
+ public:
+  bool open(int id, const minilog::SinkConfig& cfg);
+  void close();
+  int getId() const {
+    return id_;
+  }
+  const minilog::SinkConfig& getConfig() const {
+    return cfg_;
+  }
+  // `data` is the message in the format of this sink (not used for SinkFormat_Binary)
+  void write(const LogMessage& m, const char* data, size_t size);
+  size_t readMemory(char* buffer, size_t bufferSize) const;
+
+ private:
+  void writeData(minilog::eLogLevel level, const char* data, size_t size);
+  void flush();
+
+ private:
+  int id_ = -1;
+  minilog::SinkConfig cfg_ = {};
+  std::string fileName_;
+  std::string syslogTag_;
+  // Sink_File
+  LogFile file_;
+  BinaryLogWriter binaryWriter_;
+  // Sink_Syslog
+  int socket_ = -1;
+  uint8_t address_[16] = {}; // sockaddr_in
+  // Sink_Memory
+  std::vector<char> memory_;
+  size_t memoryPos_ = 0;
+  bool memoryWrapped_ = false;
+};
+
+// LogConfig::profiler: scopes of one thread, appended only by that thread and read by profilerExport() from any thread
+class ProfilerBuffer {
+ public:
+  struct Event {
+    uint64_t begin; // getCurrentTicks()
+    uint64_t end;
+    uint32_t nameIndex;
+  };
+  static constexpr uint32_t kChunkSize = 4096; // events
+  static constexpr uint32_t kMaxChunks = 1024;
+  static constexpr uint32_t kMaxNames = 4096; // distinct scope names, the rest are exported as "?"
+  static constexpr uint32_t kNameTableSize = 2 * kMaxNames;
+
+  explicit ProfilerBuffer(const char* threadName) : threadName_(threadName) {}
+  ~ProfilerBuffer();
+  void add(const char* name, uint64_t begin, uint64_t end);
+  void setThreadName(const char* name) {
+    threadName_.store(name, std::memory_order_relaxed);
+  }
+  const char* getThreadName() const {
+    return threadName_.load(std::memory_order_relaxed);
+  }
+  uint64_t getNumEvents() const {
+    return numEvents_.load(std::memory_order_acquire);
+  }
+  uint64_t getNumDropped() const {
+    return numDropped_.load(std::memory_order_relaxed);
+  }
+  const Event& getEvent(uint64_t i) const {
+    return chunks_[i / kChunkSize][i % kChunkSize];
+  }
+  const char* getName(uint32_t i) const {
+    return i < kMaxNames ? names_[i] : "?";
+  }
+
+ private:
+  uint32_t internName(const char* name);
+
+  std::atomic<const char*> threadName_;
+  std::atomic<uint64_t> numEvents_ = 0; // published with release after the event (and its name) is written
+  std::atomic<uint64_t> numDropped_ = 0;
+  Event* chunks_[kMaxChunks] = {};
+  // open addressing by the name contents: index + 1 (0 - empty slot)
+  uint32_t nameTable_[kNameTableSize] = {};
+  uint32_t nameHashes_[kMaxNames] = {};
+  char* names_[kMaxNames] = {};
+  uint32_t numNames_ = 0;
+};
+
+// LogConfig::rateLimitPerSecond: the state of one call site (format string)
+struct RateLimitSite {
+  std::atomic<const char*> site = nullptr;
+  std::atomic<uint64_t> tat = 0; // theoretical arrival time in getCurrentTicks()
+  std::atomic<uint64_t> numSuppressed = 0;
+};
+
+static constexpr uint32_t kMaxRateLimitSites = 1024;
+
+// a message kept in memory by LogConfig::backtraceSize, the text is laid out just like in a MessageRing slot
+struct BacktraceEntry {
+  uint64_t timeStamp;
+  const char* format; // nullptr - the text is already formatted
+  minilog::eLogLevel level;
+  uint8_t flags; // MessageRing::Flag_CustomTimeStamp, Flag_Structured and Flag_Details
+  uint16_t callstackOffset;
+  uint32_t msgOffset;
+  char text[MessageRing::kTextSize];
+};
+
+// messages which do not fit into the stack buffer of submitMessageSync() or logf() are formatted here, see MessageBuffer
+struct OverflowArena {
+  std::unique_ptr<char[]> data;
+  size_t size = 0;
+  bool inUse = false;
+};
+
+// grows `arena` to at least `size` bytes and moves the first `keep` bytes of `data` there
+static char* growOverflowArena(OverflowArena& arena, const char* data, size_t keep, size_t size) {
+  constexpr size_t kMinOverflowSize = 16 * 1024;
+
+  if (arena.size < size) {
+    size_t capacity = kMinOverflowSize;
+    while (capacity < size)
+      capacity *= 2;
+    std::unique_ptr<char[]> grown(new char[capacity]);
+    memcpy(grown.get(), data, keep);
+    arena.data = std::move(grown);
+    arena.size = capacity;
+  } else if (data != arena.data.get()) {
+    memcpy(arena.data.get(), data, keep);
+  }
+
+  return arena.data.get();
+}
+
+static void releaseOverflowArena(OverflowArena& arena) {
+  constexpr size_t kMaxRetainedSize = 1024 * 1024;
+
+  arena.inUse = false;
+
+  // a single huge message should not pin its buffer for the lifetime of the thread
+  if (arena.size > kMaxRetainedSize) {
+    arena.data.reset();
+    arena.size = 0;
+  }
+}
+
+struct ThreadLogContext {
+  uint64_t threadId = 0; // the kernel thread id (gettid() on Linux), matches top and perf
+  uint32_t threadIndex = 0; // a small number assigned on first use, unique within the process
+  const char* threadName = nullptr; // interned, see ThreadNameRegistry
   // callstack
   const char* procs[kMaxProcsNesting];
   uint32_t procsNestingLevel = 0;
   bool hasLogsOnThisLevel[kMaxProcsNesting] = {false};
+  // all procs concatenated on push, procsPrefixLength[i] is the length of the first i procs (those which fit)
+  char procsPrefix[kMaxProcsPrefixLength];
+  uint32_t procsPrefixLength[kMaxProcsNesting + 1] = {};
+  // backtrace ring, written and read only by this thread
+  std::unique_ptr<BacktraceEntry[]> backtrace;
+  uint32_t backtraceCapacity = 0;
+  uint64_t backtraceCount = 0; // messages stored since the last dump
+  // LogConfig::coalesceDuplicates, the pending repeats can be reported by any thread (see reportRepeatedMessages())
+  const char* lastFormat = nullptr;
+  std::atomic<minilog::eLogLevel> lastLevel = minilog::Log;
+  uint64_t lastHash = 0;
+  bool isLastHashed = false; // the arguments are hashed only if the format string repeats, see isRepeatedMessage()
+  std::atomic<uint32_t> numRepeats = 0;
+  std::atomic<uint64_t> firstRepeatTicks = 0;
+  bool isCoalescing = false; // registered in coalescingContexts
+  // profiler
+  uint64_t procsBeginTicks[kMaxProcsNesting]; // 0 - the scope was entered without LogConfig::profiler
+  ProfilerBuffer* profilerBuffer = nullptr;
+  uint32_t profilerGeneration = 0;
+  // LogConfig::threadBuffers
+  ThreadBuffer* threadBuffer = nullptr;
+  uint32_t threadBufferGeneration = 0;
+  // LogConfig::stats
+  uint32_t statsShard = ~0u;
+  // long messages: [0] - the text, [1] - the captured arguments of the binary log, [2] - logf()
+  OverflowArena overflow[3];
+
+  ~ThreadLogContext(); // hands the thread buffer over to the collector
+};
+
+// LogConfig::stats: the counters of a group of threads, summed up by getStats()
+struct alignas(MessageRing::kCacheLineSize) StatsShard {
+  std::atomic<uint64_t> numMessages[minilog::FatalError + 1];
+  std::atomic<uint64_t> numDropped;
+  std::atomic<uint64_t> numSuppressed;
+  std::atomic<uint64_t> mutexWaitNs;
+  std::atomic<uint64_t> queueWaitNs;
+  std::atomic<uint64_t> latency[minilog::Stats::kNumLatencyBuckets];
+};
+
+static constexpr uint32_t kNumStatsShards = 16;
+
+// thread names are interned: every distinct name is stored once and never freed, so messages carry and compare plain pointers
+class ThreadNameRegistry {
+ public:
+  const char* intern(const char* name) {
+    if (!name)
+      return nullptr;
+    std::lock_guard<std::mutex> lock(mutex_);
+    return names_.emplace(name).first->c_str();
+  }
+
+ private:
+  std::mutex mutex_;
+  std::unordered_set<std::string> names_; // node-based, the strings never move
 };
 
+namespace {
+minilog::LogConfig config = {};
+LogFile logFile;
+std::mutex logMutex;
+CallbackRegistry callbackRegistry;
+CallbackDispatcher callbackDispatcher;
+ConsoleWriter consoleWriter;
+AsyncQueue asyncQueue;
+ThreadBufferCollector threadBufferCollector;
+BinaryLogWriter binaryLogWriter;
+LogCompressor logCompressor;
+FlushTimer flushTimer;
+std::vector<Sink*> sinks; // guarded by logMutex
+int nextSinkId = 0;
+// the lowest level any text sink wants, read by producers deciding whether to format text in the binary mode
+std::atomic<int> minTextSinkLevel = minilog::FatalError + 1;
+std::atomic<bool> hasDetailsSinks = false; // any JSON or binary sink, see isDetailsNeeded()
+// the lowest level any output wants, with LogConfig::backtraceSize everything below goes to the backtrace ring
+std::atomic<int> minOutputLevel = minilog::Debug;
+RateLimitSite rateLimitSites[kMaxRateLimitSites];
+uint64_t rateLimitIntervalTicks = 0; // the time to earn one token
+uint64_t rateLimitToleranceTicks = 0; // burst
+uint64_t suppressedReportIntervalTicks = 0;
+std::atomic<uint64_t> nextSuppressedReportTicks = 0;
+std::mutex coalescingMutex;
+std::vector<ThreadLogContext*> coalescingContexts; // guarded by coalescingMutex, live threads with LogConfig::coalesceDuplicates
+std::atomic<uint64_t> nextRepeatsReportTicks = 0;
+std::mutex profilerMutex;
+std::vector<ProfilerBuffer*> profilerBuffers; // guarded by profilerMutex, every thread which recorded anything
+std::atomic<uint32_t> profilerGeneration = 1; // deinitialize() discards all buffers, threads notice it and start new ones
+uint64_t profilerStartTicks = 0;
+std::mutex categoryMutex;
+// categories are never destroyed, call sites keep pointers to them
+std::unordered_map<std::string, minilog::Category*> categories; // guarded by categoryMutex
+int categoryDefaultLevel = -1; // set by "*" (-1 - LogConfig::logLevel), guarded by categoryMutex
+std::atomic<bool> categoryReloadRequested(false); // set from signal handlers
+uint64_t categoryLastCheckMs = 0; // guarded by logMutex
+time_t categoryFileModifiedTime = 0; // guarded by logMutex
+int64_t categoryFileSize = -1; // guarded by logMutex
+ThreadNameRegistry threadNameRegistry;
+std::atomic<uint32_t> nextThreadIndex = 0;
+const char* mainThreadName = nullptr; // interned LogConfig::mainThreadName
+StatsShard statsShards[kNumStatsShards];
+std::atomic<uint32_t> nextStatsShard = 0;
+std::atomic<uint64_t> statsBytesWritten = 0; // written under logMutex (or by sinks), read by getStats()
+std::atomic<uint64_t> statsNumFlushes = 0;
+double statsNsPerTick = 1.0;
+uint64_t statsReportIntervalTicks = 0;
+std::atomic<uint64_t> nextStatsReportTicks = 0;
+} // namespace
+
+static_assert(std::atomic<bool>::is_always_lock_free, "categoryRequestReload() has to be async-signal-safe");
+
+std::atomic<int> minilog::detail::minEnabledLevel = minilog::Debug;
+
 #if OS_APPLE
 static os_log_type_t logLevelToOsLogType(minilog::eLogLevel level) {
   switch (level) {
@@ -117,17 +979,22 @@ static os_log_type_t logLevelToOsLogType(minilog::eLogLevel level) {
 }
 #endif
 
-static void invokeCallbacks(minilog::eLogLevel level, const char* msg) {
-  for (uint32_t i = 0; i != callbacksNum; i++) {
-    if (callbacks[i].funcs[level])
-      callbacks[i].funcs[level](callbacks[i].userData, msg);
-  }
+// with a binary log file, text is formatted only for the console and callbacks
+static bool isTextNeeded(minilog::eLogLevel level, bool printToConsole) {
+#if OS_ANDROID
+  return true;
+#else
+  return !config.binaryLog || (printToConsole && level >= config.logLevelPrintToConsole) || callbackRegistry.has(level) ||
+         level >= minTextSinkLevel.load(std::memory_order_relaxed);
+#endif // OS_ANDROID
 }
 
-static void writeHTMLIntro(const char* pageTitle, const char* customHeader) {
-  if (!logFile)
-    return;
+// JSON and binary outputs need MessageDetails
+static bool isDetailsNeeded() {
+  return config.jsonLog || config.binaryLog || hasDetailsSinks.load(std::memory_order_relaxed);
+}
 
+static std::string getHTMLIntro(const char* pageTitle, const char* customHeader) {
   const char* header =
       customHeader
           ? customHeader
@@ -150,37 +1017,150 @@ static void writeHTMLIntro(const char* pageTitle, const char* customHeader) {
 
             "</style></head>\n";
 
-  fprintf(logFile, header, pageTitle);
-  fprintf(logFile, "<body><h1>%s</h1>\n", pageTitle);
+  std::string intro(size_t(snprintf(nullptr, 0, header, pageTitle)), 0);
+  snprintf(&intro[0], intro.size() + 1, header, pageTitle);
+
+  intro += "<body><h1>";
+  intro += pageTitle;
+  intro += "</h1>\n";
+
+  return intro;
+}
+
+static const char* getHTMLOutro(const char* customFooter) {
+  return customFooter ? customFooter : "</body></html>\n";
+}
+
+static void writeHTMLIntro(const char* pageTitle, const char* customHeader) {
+  if (!logFile.isOpen())
+    return;
+
+  const std::string intro = getHTMLIntro(pageTitle, customHeader);
+
+  logFile.write(intro.data(), intro.size());
 }
 
 static void writeHTMLOutro(const char* customFooter) {
-  if (!logFile)
+  if (!logFile.isOpen())
     return;
 
-  const char* footer = customFooter ? customFooter : "</body></html>\n";
+  const char* footer = getHTMLOutro(customFooter);
+
+  logFile.write(footer, strlen(footer));
+}
+
+// LogConfig::logLevel and sink levels, under logMutex (or in non-thread-safe initialize())
+static void updateEnabledLevels();
+static void updateInheritedCategoryLevels();
+static void reloadCategoryLevelsIfDue();
+static void stopProfiler();
+static uint64_t getCurrentTicks();
+static uint64_t getTicksPerSecond();
+static void flushSuppressedMessages();
+static void reportStats(ThreadLogContext* ctx);
+static ThreadLogContext* getThreadLogContext();
+static char* writeJSONLine(char* buffer, const char* bufferEnd, const LogMessage& m, minilog::eTimeStampPrecision precision);
+
+static void removeAllSinks() {
+  std::lock_guard<std::mutex> lock(logMutex);
+
+  for (Sink* sink : sinks) {
+    sink->close();
+    delete sink;
+  }
+
+  sinks.clear();
+
+  updateEnabledLevels();
+}
+
+static void updateEnabledLevels() {
+  int minLevel = config.logLevel;
+  int minTextLevel = minilog::FatalError + 1;
+  bool hasDetails = false;
+
+  for (const Sink* sink : sinks) {
+    const minilog::SinkConfig& cfg = sink->getConfig();
+    minLevel = cfg.minLevel < minLevel ? cfg.minLevel : minLevel;
+    if (cfg.format != minilog::SinkFormat_Binary)
+      minTextLevel = cfg.minLevel < minTextLevel ? cfg.minLevel : minTextLevel;
+    hasDetails = hasDetails || cfg.format == minilog::SinkFormat_JSON || cfg.format == minilog::SinkFormat_Binary;
+  }
 
-  fprintf(logFile, "%s", footer);
+  minOutputLevel.store(minLevel, std::memory_order_relaxed);
+  minilog::detail::minEnabledLevel.store(config.backtraceSize ? int(minilog::Paranoid) : minLevel, std::memory_order_relaxed);
+  minTextSinkLevel.store(minTextLevel, std::memory_order_relaxed);
+  hasDetailsSinks.store(hasDetails, std::memory_order_relaxed);
 }
 
 bool minilog::initialize(const char* fileName, const minilog::LogConfig& cfg) {
-  if (logFile)
+  if (logFile.isOpen() || asyncQueue.isRunning() || threadBufferCollector.isRunning() || callbackDispatcher.isRunning() ||
+      consoleWriter.isRunning())
     deinitialize();
 
   if (fileName) {
-    logFile = fopen(fileName, "w");
-
-    if (!logFile)
+    if (!logFile.open(fileName, cfg))
       return false;
   }
 
   minilog::threadNameSet(cfg.mainThreadName);
 
+  mainThreadName = getThreadLogContext()->threadName;
+
   config = cfg;
 
-  if (cfg.htmlLog)
+  consoleWriter.start(cfg);
+
+  profilerStartTicks = getCurrentTicks();
+
+  const uint64_t ticksPerSecond = getTicksPerSecond();
+  minilog::resetStats();
+  statsNsPerTick = 1e9 / double(ticksPerSecond);
+  statsReportIntervalTicks = cfg.stats ? ticksPerSecond * cfg.statsReportIntervalSec : 0;
+  nextStatsReportTicks.store(profilerStartTicks + statsReportIntervalTicks, std::memory_order_relaxed);
+  const unsigned int burst = cfg.rateLimitBurst ? cfg.rateLimitBurst : cfg.rateLimitPerSecond;
+  rateLimitIntervalTicks = cfg.rateLimitPerSecond ? ticksPerSecond / cfg.rateLimitPerSecond : 0;
+  rateLimitToleranceTicks = burst > 1 ? rateLimitIntervalTicks * (burst - 1) : 0;
+  suppressedReportIntervalTicks = ticksPerSecond * cfg.suppressedReportIntervalMs / 1000;
+  nextSuppressedReportTicks.store(profilerStartTicks + suppressedReportIntervalTicks, std::memory_order_relaxed);
+  nextRepeatsReportTicks.store(profilerStartTicks + suppressedReportIntervalTicks, std::memory_order_relaxed);
+  for (RateLimitSite& s : rateLimitSites) {
+    s.site.store(nullptr, std::memory_order_relaxed);
+    s.tat.store(0, std::memory_order_relaxed);
+    s.numSuppressed.store(0, std::memory_order_relaxed);
+  }
+
+  updateEnabledLevels();
+  updateInheritedCategoryLevels();
+
+  if (cfg.categoryControlFile) {
+    categoryLastCheckMs = 0;
+    categoryFileModifiedTime = 0;
+    categoryFileSize = -1;
+    reloadCategoryLevelsIfDue();
+  }
+
+  if (cfg.binaryLog)
+    binaryLogWriter.begin(logFile);
+  else if (cfg.htmlLog && !cfg.jsonLog)
     writeHTMLIntro(cfg.htmlPageTitle, cfg.htmlPageHeader);
 
+  if (cfg.callbackThread)
+    callbackDispatcher.start(cfg.asyncQueueCapacity, cfg.asyncQueueFullPolicy);
+
+  if (cfg.asyncMode) {
+    asyncQueue.start(cfg.asyncQueueCapacity, cfg.asyncQueueFullPolicy);
+  } else if (cfg.threadBuffers) {
+    threadBufferCollector.start(cfg.threadBufferSize, cfg.threadBufferFlushIntervalMs, cfg.asyncQueueFullPolicy);
+  } else if (logFile.isOpen() && (cfg.fileBackend == minilog::FileBackend_Batched || cfg.fileBackend == minilog::FileBackend_IoUring)) {
+    const bool isSyncDue = cfg.fileBackend == minilog::FileBackend_IoUring && cfg.durabilityIntervalMs;
+    const unsigned int intervalMs = isSyncDue && cfg.durabilityIntervalMs < cfg.batchFlushIntervalMs
+                                        ? cfg.durabilityIntervalMs
+                                        : cfg.batchFlushIntervalMs;
+    if (intervalMs)
+      flushTimer.start(intervalMs);
+  }
+
   if (cfg.writeIntro) {
     log(minilog::Log, "minilog: initializing ...");
     log(minilog::Log, "minilog: log file: %s", fileName);
@@ -190,19 +1170,42 @@ bool minilog::initialize(const char* fileName, const minilog::LogConfig& cfg) {
 }
 
 void minilog::deinitialize() {
-  if (!logFile)
+  flushSuppressedMessages();
+
+  if (config.stats && config.statsReportAtExit)
+    reportStats(getThreadLogContext());
+
+  if (!logFile.isOpen()) {
+    flushTimer.stop();
+    asyncQueue.stop();
+    threadBufferCollector.stop();
+    callbackDispatcher.stop();
+    removeAllSinks();
+    consoleWriter.stop();
+    stopProfiler();
     return;
+  }
 
   if (config.writeOutro)
     log(minilog::Log, "minilog: deinitializing...");
 
-  if (config.htmlLog)
+  // everything queued so far has to reach the log file before the outro
+  flushTimer.stop();
+  asyncQueue.stop();
+  threadBufferCollector.stop();
+  callbackDispatcher.stop();
+
+  removeAllSinks();
+  consoleWriter.stop();
+  stopProfiler();
+
+  if (config.htmlLog && !config.binaryLog && !config.jsonLog)
     writeHTMLOutro(config.htmlPageFooter);
 
-  fflush(logFile);
-  fclose(logFile);
+  logFile.close();
 
-  logFile = nullptr;
+  // compress the remaining rotated segments
+  logCompressor.stop();
 }
 
 static uint64_t getCurrentThreadHandle() {
@@ -210,281 +1213,4892 @@ static uint64_t getCurrentThreadHandle() {
   return GetCurrentThreadId();
 #elif OS_APPLE
   return pthread_mach_thread_np(pthread_self());
+#elif defined(__linux__)
+  return uint64_t(syscall(SYS_gettid));
 #else
-  return pthread_self();
+  return uint64_t(uintptr_t(pthread_self()));
 #endif
 }
 
 static ThreadLogContext* getThreadLogContext() {
   static thread_local ThreadLogContext ctx;
 
-  if (!ctx.threadId)
+  if (!ctx.threadId) {
     ctx.threadId = getCurrentThreadHandle();
+    ctx.threadIndex = nextThreadIndex.fetch_add(1, std::memory_order_relaxed);
+  }
 
   return &ctx;
 }
 
-unsigned int minilog::getCurrentMilliseconds() {
-#if OS_WINDOWS
-  SYSTEMTIME st;
-  GetSystemTime(&st);
-  return st.wMilliseconds;
-#else
-  struct timeval timeVal;
-  gettimeofday(&timeVal, nullptr);
-  return timeVal.tv_usec / 1000;
-#endif
-}
+/// LogConfig::stats
 
-static char* writeTimeStamp(char* buffer, const char* bufferEnd) {
-  time_t tempTime;
-  time(&tempTime);
-  ::tm tmTime;
-#if OS_WINDOWS
-  localtime_s(&tmTime, &tempTime);
-#else
-  localtime_r(&tempTime, &tmTime);
-#endif
+static StatsShard& getStatsShard() {
+  ThreadLogContext* ctx = getThreadLogContext();
 
-  const int n = snprintf(buffer,
-                         uint32_t(bufferEnd - buffer),
-                         "%02d:%02d:%02d.%03d   ",
-                         tmTime.tm_hour,
-                         tmTime.tm_min,
-                         tmTime.tm_sec,
-                         minilog::getCurrentMilliseconds());
+  if (ctx->statsShard == ~0u)
+    ctx->statsShard = nextStatsShard.fetch_add(1, std::memory_order_relaxed) % kNumStatsShards;
 
-  return buffer + n;
+  return statsShards[ctx->statsShard];
 }
 
-static char* writeCurrentProcsNesting(char* buffer, const char* bufferEnd) {
-  ThreadLogContext* ctx = getThreadLogContext();
+static uint64_t ticksToNs(uint64_t ticks) {
+  return uint64_t(double(ticks) * statsNsPerTick);
+}
 
-  for (int i = 0; i != ctx->procsNestingLevel; i++) {
-    const size_t len = strlen(ctx->procs[i]);
-    if (buffer + len >= bufferEnd)
-      break;
-    strncpy(buffer, ctx->procs[i], len);
-    buffer += len;
-  }
-  return buffer;
+static void countDropped() {
+  if (config.stats)
+    getStatsShard().numDropped.fetch_add(1, std::memory_order_relaxed);
 }
 
-static const char* kHTMLPrefix[] = {
-    "<div id=\"p1\">", // Paranoid
-    "<div id=\"p2\">", // Paranoid
-    "<div id=\"l1\">", // Debug
-    "<div id=\"l2\">", // Debug
-    "<div id=\"l1\">", // Log
-    "<div id=\"l2\">", // Log
-    "<div id=\"w1\">", // Warning
-    "<div id=\"w2\">", // Warning
-    "<div id=\"w1\">", // FatalError
-    "<div id=\"w2\">" // FatalError
-};
+static void countSuppressed() {
+  if (config.stats)
+    getStatsShard().numSuppressed.fetch_add(1, std::memory_order_relaxed);
+}
 
-static void writeMessageToLog(minilog::eLogLevel level, const char* msg, const ThreadLogContext* ctx) {
-#if OS_ANDROID
-  if (ctx->threadName)
-    __android_log_print(ANDROID_LOG_INFO, "minilog", "(%s):%s", ctx->threadName, msg);
-  else
-    __android_log_print(ANDROID_LOG_INFO, "minilog", "(%llu):%s", (unsigned long long)ctx->threadId, msg);
-#endif
+static void countFlush() {
+  if (config.stats)
+    statsNumFlushes.fetch_add(1, std::memory_order_relaxed);
+}
 
-  if (!logFile)
-    return;
+// HDR-style log-linear buckets: exact below 8 ns, then 8 linear buckets per power of two
+static uint32_t getLatencyBucket(uint64_t ns) {
+  if (ns < 8)
+    return uint32_t(ns);
 
-  if (config.threadNames)
-    if (ctx->threadName)
-      if (config.htmlLog) {
-        const int threadID = strcmp(ctx->threadName, config.mainThreadName) ? 1 : 0;
-        fprintf(logFile, "%s(%s):%s</div>\n", kHTMLPrefix[2 * level + threadID], ctx->threadName, msg);
-      } else
-        fprintf(logFile, "(%s):%s\n", ctx->threadName, msg);
-    else if (config.htmlLog)
-      fprintf(logFile, "%s(%llu):%s</div>\n", kHTMLPrefix[2 * level], (unsigned long long)ctx->threadId, msg);
-    else
-      fprintf(logFile, "(%llu):%s\n", (unsigned long long)ctx->threadId, msg);
-  else {
-    if (config.htmlLog)
-      fprintf(logFile, "%s%s</div>\n", kHTMLPrefix[2 * level], msg);
-    else
-      fprintf(logFile, "%s\n", msg);
-  }
+#if defined(_MSC_VER)
+  unsigned long msb = 0;
+  _BitScanReverse64(&msb, ns);
+#else
+  const uint32_t msb = 63u - uint32_t(__builtin_clzll(ns));
+#endif // _MSC_VER
+
+  const uint32_t bucket = (uint32_t(msb) - 2) * 8 + uint32_t((ns >> (msb - 3)) & 7);
 
-  if (config.forceFlush)
-    fflush(logFile);
+  return bucket < minilog::Stats::kNumLatencyBuckets ? bucket : minilog::Stats::kNumLatencyBuckets - 1;
 }
 
-void minilog::threadNameSet(const char* name) {
-  ThreadLogContext* ctx = getThreadLogContext();
+// measures one log(), logf() or logRaw() call
+class StatsCallTimer {
+ public:
+  StatsCallTimer() : start_(config.stats ? getCurrentTicks() : 0) {}
+  ~StatsCallTimer() {
+    if (start_)
+      getStatsShard().latency[getLatencyBucket(ticksToNs(getCurrentTicks() - start_))].fetch_add(1, std::memory_order_relaxed);
+  }
+  uint64_t getStartTicks() const {
+    return start_;
+  }
 
-  ctx->threadName = name;
-}
+ private:
+  const uint64_t start_;
+};
 
-const char* minilog::threadNameGet() {
-  ThreadLogContext* ctx = getThreadLogContext();
+// measures a waiting loop from its first failed attempt, see MessageRing::claim()
+class StatsWaitTimer {
+ public:
+  ~StatsWaitTimer() {
+    if (start_)
+      getStatsShard().queueWaitNs.fetch_add(ticksToNs(getCurrentTicks() - start_), std::memory_order_relaxed);
+  }
+  void start() {
+    if (!start_ && config.stats)
+      start_ = getCurrentTicks();
+  }
 
-  return ctx->threadName ? ctx->threadName : "";
+ private:
+  uint64_t start_ = 0;
+};
+
+// logMutex for logging threads, the time spent waiting for it is counted only if it is contended
+static std::unique_lock<std::mutex> lockLogMutex() {
+  std::unique_lock<std::mutex> lock(logMutex, std::try_to_lock);
+
+  if (!lock.owns_lock()) {
+    const uint64_t start = config.stats ? getCurrentTicks() : 0;
+    lock.lock();
+    if (start)
+      getStatsShard().mutexWaitNs.fetch_add(ticksToNs(getCurrentTicks() - start), std::memory_order_relaxed);
+  }
+
+  return lock;
 }
 
-static void printMessageToConsole(minilog::eLogLevel level, const char* msg, const ThreadLogContext* ctx) {
-  using namespace minilog;
+// wall clock time in nanoseconds since the Unix epoch
+static uint64_t getCurrentTimeNs() {
+#if OS_WINDOWS
+  FILETIME ft;
+  GetSystemTimePreciseAsFileTime(&ft);
+  const uint64_t ticks = (uint64_t(ft.dwHighDateTime) << 32) | ft.dwLowDateTime; // 100ns intervals since 1601
+  return (ticks - 116444736000000000ull) * 100;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return uint64_t(ts.tv_sec) * 1000000000ull + uint64_t(ts.tv_nsec);
+#endif
+}
 
-  if (level >= config.logLevelPrintToConsole) {
-    if (config.coloredConsole) {
+// raw monotonic ticks for TimeStamp_Ticks (nanoseconds on POSIX, QueryPerformanceCounter() on Windows)
+static uint64_t getCurrentTicks() {
 #if OS_WINDOWS
-      auto getAttr = [](minilog::eLogLevel level) -> WORD {
-        switch (level) {
-        case Paranoid:
-          return FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE;
-        case Debug:
-          return FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE;
-        case Log:
-          return FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE | FOREGROUND_INTENSITY;
-        case Warning:
-          return FOREGROUND_RED | FOREGROUND_INTENSITY;
-        case FatalError:
-          return FOREGROUND_RED | FOREGROUND_INTENSITY;
-        }
-        return FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE;
-      };
-      SetConsoleTextAttribute(GetStdHandle(STD_OUTPUT_HANDLE), getAttr(level));
+  LARGE_INTEGER counter;
+  QueryPerformanceCounter(&counter);
+  return uint64_t(counter.QuadPart);
 #else
-      // ANSI colors for macOS and Linux terminals
-      switch (level) {
-      case Paranoid:
-        printf("\033[0;90m");
-        break;
-      case Debug:
-        printf("\033[0m");
-        break;
-      case Log:
-        printf("\033[1m");
-        break;
-      case Warning:
-        printf("\033[1;33m");
-        break;
-      case FatalError:
-        printf("\033[1;31m");
-        break;
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return uint64_t(ts.tv_sec) * 1000000000ull + uint64_t(ts.tv_nsec);
+#endif
+}
+
+static uint64_t getTicksPerSecond() {
+#if OS_WINDOWS
+  LARGE_INTEGER frequency;
+  QueryPerformanceFrequency(&frequency);
+  return uint64_t(frequency.QuadPart);
+#else
+  return 1000000000ull;
+#endif // OS_WINDOWS
+}
+
+// the only clock read per message; everything else in the time stamp is derived from this value
+static uint64_t getTimeStamp() {
+  return config.timeStampPrecision == minilog::TimeStamp_Ticks ? getCurrentTicks() : getCurrentTimeNs();
+}
+
+unsigned int minilog::getCurrentMilliseconds() {
+  return unsigned(getCurrentTimeNs() / 1000000ull % 1000ull);
+}
+
+// writes exactly `numDigits` decimal digits of `value` (with leading zeros)
+static char* writeDigits(char* buffer, uint64_t value, uint32_t numDigits) {
+  for (uint32_t i = numDigits; i != 0; i--) {
+    buffer[i - 1] = char('0' + value % 10);
+    value /= 10;
+  }
+  return buffer + numDigits;
+}
+
+// copies as much of `str` as fits, returns the end of the copied string (not 0-terminated)
+static char* copyString(char* buffer, const char* bufferEnd, const char* str) {
+  while (*str && buffer < bufferEnd)
+    *buffer++ = *str++;
+  return buffer;
+}
+
+// writes all digits or nothing
+static char* writeInteger(char* buffer, const char* bufferEnd, uint64_t value, bool negative) {
+  uint32_t numDigits = 1;
+  for (uint64_t v = value; v >= 10; v /= 10)
+    numDigits++;
+  if (bufferEnd - buffer < ptrdiff_t(numDigits + (negative ? 1 : 0)))
+    return buffer;
+  if (negative)
+    *buffer++ = '-';
+  return writeDigits(buffer, value, numDigits);
+}
+
+// writes `length` bytes of `str` as a quoted JSON string, escaping only what JSON requires; if it does not fit, the string
+// is cut but always closed
+static char* writeJSONString(char* buffer, const char* bufferEnd, const char* str, size_t length) {
+  static const char kHexDigits[] = "0123456789abcdef";
+
+  if (bufferEnd - buffer < 2)
+    return buffer;
+
+  *buffer++ = '"';
+
+  const char* end = bufferEnd - 1; // the closing quote
+  const char* strEnd = str + length;
+
+  while (str != strEnd) {
+    // copy runs of characters which need no escaping at once
+    const char* run = str;
+    while (run != strEnd && uint8_t(*run) >= 0x20 && *run != '"' && *run != '\\')
+      run++;
+    const size_t n = size_t(run - str) < size_t(end - buffer) ? size_t(run - str) : size_t(end - buffer);
+    memcpy(buffer, str, n);
+    buffer += n;
+    if (str + n != run || run == strEnd)
+      break;
+    str = run;
+
+    const uint8_t c = uint8_t(*str++);
+    char escape = 0;
+    switch (c) {
+    case '"':
+    case '\\':
+      escape = char(c);
+      break;
+    case '\b':
+      escape = 'b';
+      break;
+    case '\f':
+      escape = 'f';
+      break;
+    case '\n':
+      escape = 'n';
+      break;
+    case '\r':
+      escape = 'r';
+      break;
+    case '\t':
+      escape = 't';
+      break;
+    }
+    if (end - buffer < (escape ? 2 : 6))
+      break;
+    *buffer++ = '\\';
+    if (escape) {
+      *buffer++ = escape;
+    } else {
+      memcpy(buffer, "u00", 3);
+      buffer[3] = kHexDigits[c >> 4];
+      buffer[4] = kHexDigits[c & 15];
+      buffer += 5;
+    }
+  }
+
+  *buffer++ = '"';
+
+  return buffer;
+}
+
+// "Proc->" and "Proc()->" become "Proc" and "Proc()"
+static size_t getProcNameLength(const char* name, size_t length) {
+  return length > 2 && !memcmp(name + length - 2, "->", 2) ? length - 2 : length;
+}
+
+static char* writeTimeStampAt(char* buffer, const char* bufferEnd, uint64_t timeStamp, minilog::eTimeStampPrecision precision) {
+  // "HH:MM:SS.nnnnnnnnn   " or 20 digits of ticks + 3 spaces
+  constexpr ptrdiff_t kMaxTimeStampLength = 24;
+
+  if (bufferEnd - buffer < kMaxTimeStampLength)
+    return buffer;
+
+  char* p = buffer;
+
+  if (precision == minilog::TimeStamp_Ticks) {
+    uint32_t numDigits = 1;
+    for (uint64_t v = timeStamp; v >= 10; v /= 10)
+      numDigits++;
+    p = writeDigits(p, timeStamp, numDigits);
+  } else {
+    // localtime() is called only when the second changes
+    struct TimeStampCache {
+      uint64_t seconds = ~0ull;
+      char hms[8];
+    };
+    static thread_local TimeStampCache cache;
+
+    const uint64_t seconds = timeStamp / 1000000000ull;
+    const uint32_t ns = uint32_t(timeStamp % 1000000000ull);
+
+    if (seconds != cache.seconds) {
+      const time_t tempTime = time_t(seconds);
+      ::tm tmTime;
+#if OS_WINDOWS
+      localtime_s(&tmTime, &tempTime);
+#else
+      localtime_r(&tempTime, &tmTime);
+#endif
+      writeDigits(cache.hms + 0, uint32_t(tmTime.tm_hour), 2);
+      cache.hms[2] = ':';
+      writeDigits(cache.hms + 3, uint32_t(tmTime.tm_min), 2);
+      cache.hms[5] = ':';
+      writeDigits(cache.hms + 6, uint32_t(tmTime.tm_sec), 2);
+      cache.seconds = seconds;
+    }
+
+    memcpy(p, cache.hms, sizeof(cache.hms));
+    p += sizeof(cache.hms);
+    *p++ = '.';
+
+    switch (precision) {
+    case minilog::TimeStamp_Microseconds:
+      p = writeDigits(p, ns / 1000, 6);
+      break;
+    case minilog::TimeStamp_Nanoseconds:
+      p = writeDigits(p, ns, 9);
+      break;
+    default:
+      p = writeDigits(p, ns / 1000000, 3);
+      break;
+    }
+  }
+
+  memcpy(p, "   ", 4);
+
+  return p + 3;
+}
+
+/// log files
+
+#if !OS_WINDOWS
+// writev() everything handling partial writes and EINTR
+static void writeAll(int fd, struct iovec* iov, int numIov) {
+  while (numIov > 0) {
+    const ssize_t written = writev(fd, iov, numIov);
+
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      return;
+    }
+
+    size_t left = size_t(written);
+
+    while (numIov > 0 && left >= iov->iov_len) {
+      left -= iov->iov_len;
+      iov++;
+      numIov--;
+    }
+
+    if (numIov > 0) {
+      iov->iov_base = static_cast<char*>(iov->iov_base) + left;
+      iov->iov_len -= left;
+    }
+  }
+}
+#endif // !OS_WINDOWS
+
+#if MINILOG_HAS_IO_URING
+static constexpr uint64_t kIoUringSyncTag = ~0ull;
+
+bool IoUringFile::open(int fd, uint32_t numBuffers, size_t bufferSize) {
+  struct io_uring_params params = {};
+
+  ringFd_ = int(syscall(__NR_io_uring_setup, numBuffers + 2, &params));
+
+  if (ringFd_ < 0)
+    return false;
+
+  fd_ = fd;
+  sqRingSize_ = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+  cqRingSize_ = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+    sqRingSize_ = cqRingSize_ = sqRingSize_ > cqRingSize_ ? sqRingSize_ : cqRingSize_;
+
+  sqRing_ = mmap(nullptr, sqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd_, IORING_OFF_SQ_RING);
+  cqRing_ = sqRing_;
+  if (sqRing_ != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP))
+    cqRing_ = mmap(nullptr, cqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd_, IORING_OFF_CQ_RING);
+  sqesSize_ = params.sq_entries * sizeof(struct io_uring_sqe);
+  void* sqes = sqRing_ != MAP_FAILED && cqRing_ != MAP_FAILED
+                   ? mmap(nullptr, sqesSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd_, IORING_OFF_SQES)
+                   : MAP_FAILED;
+
+  if (sqes == MAP_FAILED) {
+    if (cqRing_ != MAP_FAILED && cqRing_ != sqRing_)
+      munmap(cqRing_, cqRingSize_);
+    if (sqRing_ != MAP_FAILED)
+      munmap(sqRing_, sqRingSize_);
+    ::close(ringFd_);
+    ringFd_ = -1;
+    return false;
+  }
+
+  char* sq = static_cast<char*>(sqRing_);
+  char* cq = static_cast<char*>(cqRing_);
+  sqes_ = static_cast<struct io_uring_sqe*>(sqes);
+  sqTail_ = reinterpret_cast<std::atomic<uint32_t>*>(sq + params.sq_off.tail);
+  sqMask_ = *reinterpret_cast<uint32_t*>(sq + params.sq_off.ring_mask);
+  sqArray_ = reinterpret_cast<uint32_t*>(sq + params.sq_off.array);
+  cqHead_ = reinterpret_cast<std::atomic<uint32_t>*>(cq + params.cq_off.head);
+  cqTail_ = reinterpret_cast<std::atomic<uint32_t>*>(cq + params.cq_off.tail);
+  cqMask_ = *reinterpret_cast<uint32_t*>(cq + params.cq_off.ring_mask);
+  cqes_ = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+
+  buffers_.resize(numBuffers);
+  bufferSize_ = bufferSize;
+
+  std::vector<struct iovec> iov(numBuffers);
+
+  for (uint32_t i = 0; i != numBuffers; i++) {
+    buffers_[i].data = static_cast<char*>(::operator new(bufferSize, std::align_val_t(4096)));
+    iov[i] = {buffers_[i].data, bufferSize};
+  }
+
+  registered_ = syscall(__NR_io_uring_register, ringFd_, IORING_REGISTER_BUFFERS, iov.data(), numBuffers) == 0;
+  failed_ = false;
+  syncInFlight_ = false;
+  numInFlight_ = 0;
+  offset_ = 0;
+
+  return true;
+}
+
+void IoUringFile::close() {
+  if (ringFd_ < 0)
+    return;
+
+  while (numInFlight_)
+    reap(true);
+
+  munmap(sqes_, sqesSize_);
+  if (cqRing_ != sqRing_)
+    munmap(cqRing_, cqRingSize_);
+  munmap(sqRing_, sqRingSize_);
+  ::close(ringFd_); // unregisters the buffers
+
+  for (Buffer& b : buffers_)
+    ::operator delete(b.data, std::align_val_t(4096));
+  for (char* data : retired_)
+    ::operator delete(data, std::align_val_t(4096));
+
+  buffers_.clear();
+  retired_.clear();
+  ringFd_ = -1;
+  fd_ = -1;
+}
+
+char* IoUringFile::acquire() {
+  for (;;) {
+    for (Buffer& b : buffers_)
+      if (!b.inFlight)
+        return b.data;
+    // the disk is slower than logging: this is the only place where we wait
+    reap(true);
+  }
+}
+
+struct io_uring_sqe* IoUringFile::getSqe() {
+  const uint32_t tail = sqTail_->load(std::memory_order_relaxed);
+  const uint32_t index = tail & sqMask_;
+  struct io_uring_sqe* sqe = &sqes_[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqArray_[index] = index;
+  return sqe;
+}
+
+bool IoUringFile::enter(uint32_t toSubmit, uint32_t minComplete) {
+  if (toSubmit)
+    sqTail_->fetch_add(toSubmit, std::memory_order_release);
+
+  const uint32_t flags = minComplete ? IORING_ENTER_GETEVENTS : 0;
+
+  for (;;) {
+    const long result = syscall(__NR_io_uring_enter, ringFd_, toSubmit, minComplete, flags, nullptr, 0);
+    if (result >= 0)
+      return true;
+    if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      // the entries were not consumed
+      if (toSubmit)
+        sqTail_->fetch_sub(toSubmit, std::memory_order_release);
+      return false;
+    }
+    // EBUSY: the completion queue has to be drained first
+    if (errno == EBUSY)
+      reap(false);
+  }
+}
+
+void IoUringFile::abandonRing() {
+  failed_ = true;
+
+  // completions cannot be waited for, the writes in flight are repeated with pwrite() (the same data at the same offsets);
+  // the kernel may still read their buffers, those are replaced and freed only by close()
+  for (Buffer& b : buffers_) {
+    if (!b.inFlight)
+      continue;
+    writeSync(b.data, b.size, b.offset);
+    retired_.push_back(b.data);
+    b.data = static_cast<char*>(::operator new(bufferSize_, std::align_val_t(4096)));
+    b.inFlight = false;
+  }
+
+  syncInFlight_ = false;
+  numInFlight_ = 0;
+}
+
+void IoUringFile::writeSync(const char* data, size_t size, uint64_t offset) {
+  while (size) {
+    const ssize_t written = pwrite(fd_, data, size, off_t(offset));
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      return;
+    }
+    data += written;
+    size -= size_t(written);
+    offset += uint64_t(written);
+  }
+}
+
+void IoUringFile::submitWrite(char* buffer, size_t size) {
+  uint32_t index = 0;
+  while (buffers_[index].data != buffer)
+    index++;
+
+  Buffer& b = buffers_[index];
+
+  b.offset = offset_;
+  b.size = size;
+  offset_ += size;
+
+  if (failed_) {
+    writeSync(b.data, b.size, b.offset);
+    return;
+  }
+
+  struct io_uring_sqe* sqe = getSqe();
+  sqe->opcode = registered_ ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+  sqe->fd = fd_;
+  sqe->off = b.offset;
+  sqe->addr = uint64_t(uintptr_t(b.data));
+  sqe->len = uint32_t(b.size);
+  if (registered_)
+    sqe->buf_index = uint16_t(index);
+  sqe->user_data = index;
+
+  if (!enter(1, 0)) {
+    abandonRing();
+    writeSync(b.data, b.size, b.offset);
+    return;
+  }
+
+  b.inFlight = true;
+  numInFlight_++;
+}
+
+void IoUringFile::submitSync() {
+  if (failed_) {
+    fdatasync(fd_);
+    return;
+  }
+
+  // at most one sync in flight, the next one comes with the next interval
+  if (syncInFlight_)
+    return;
+
+  struct io_uring_sqe* sqe = getSqe();
+  sqe->opcode = IORING_OP_FSYNC;
+  sqe->flags = IOSQE_IO_DRAIN; // after all writes submitted before it
+  sqe->fd = fd_;
+  sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+  sqe->user_data = kIoUringSyncTag;
+
+  if (!enter(1, 0)) {
+    abandonRing();
+    fdatasync(fd_);
+    return;
+  }
+
+  syncInFlight_ = true;
+  numInFlight_++;
+}
+
+void IoUringFile::reap(bool wait) {
+  // also ignores late completions after abandonRing()
+  if (!numInFlight_)
+    return;
+
+  if (wait && cqHead_->load(std::memory_order_relaxed) == cqTail_->load(std::memory_order_acquire) && !enter(0, 1)) {
+    abandonRing();
+    return;
+  }
+
+  uint32_t head = cqHead_->load(std::memory_order_relaxed);
+  const uint32_t tail = cqTail_->load(std::memory_order_acquire);
+
+  for (; head != tail; head++) {
+    const struct io_uring_cqe& cqe = cqes_[head & cqMask_];
+    complete(cqe.user_data, cqe.res);
+  }
+
+  cqHead_->store(head, std::memory_order_release);
+}
+
+void IoUringFile::complete(uint64_t userData, int32_t result) {
+  numInFlight_--;
+
+  if (userData == kIoUringSyncTag) {
+    syncInFlight_ = false;
+    return;
+  }
+
+  Buffer& b = buffers_[userData];
+
+  // short writes are finished synchronously; errors switch the rest of this file to pwrite()
+  if (result < 0) {
+    failed_ = true;
+    writeSync(b.data, b.size, b.offset);
+  } else if (size_t(result) < b.size) {
+    writeSync(b.data + result, b.size - size_t(result), b.offset + uint64_t(result));
+  }
+
+  b.inFlight = false;
+}
+#endif // MINILOG_HAS_IO_URING
+
+bool LogFile::open(const char* fileName, const minilog::LogConfig& cfg) {
+  fileName_ = fileName;
+  cfg_ = cfg;
+  nextSegmentIndex_ = 1;
+  segments_.clear();
+
+  return openFile(false);
+}
+
+bool LogFile::openFile(bool append) {
+  const minilog::LogConfig& cfg = cfg_;
+
+  // mmap() needs the file to be readable
+  if (cfg.fileBackend == minilog::FileBackend_Mapped)
+    file_ = fopen(fileName_.c_str(), cfg.binaryLog ? "w+b" : "w+");
+  else if (append)
+    file_ = fopen(fileName_.c_str(), cfg.binaryLog ? "ab" : "a");
+  else
+    file_ = fopen(fileName_.c_str(), cfg.binaryLog ? "wb" : "w");
+
+  if (!file_)
+    return false;
+
+  fileSize_ = 0;
+  openTime_ = time(nullptr);
+
+  backend_ = cfg.fileBackend;
+  forceFlush_ = cfg.forceFlush;
+
+#if OS_WINDOWS
+  if (backend_ == minilog::FileBackend_Mapped)
+    backend_ = minilog::FileBackend_Stdio;
+#else
+  if (backend_ == minilog::FileBackend_Mapped) {
+    mappingChunk_ = cfg.mappedChunkSize > (1u << 20) ? cfg.mappedChunkSize : (1u << 20);
+    cursor_ = 0;
+    if (!growMapping(mappingChunk_)) {
+      fclose(file_);
+      file_ = nullptr;
+      return false;
+    }
+  }
+#endif // OS_WINDOWS
+
+  const size_t stagingSize = cfg.batchBufferSize > 4096 ? cfg.batchBufferSize : 4096;
+
+#if MINILOG_HAS_IO_URING
+  // falls back to FileBackend_Batched if the kernel (or a seccomp filter) does not allow io_uring
+  if (backend_ == minilog::FileBackend_IoUring &&
+      !uring_.open(fileno(file_), cfg.ioUringNumBuffers > 2 ? cfg.ioUringNumBuffers : 2, stagingSize))
+    backend_ = minilog::FileBackend_Batched;
+  if (backend_ == minilog::FileBackend_IoUring) {
+    staging_ = uring_.acquire();
+    syncIntervalTicks_ = uint64_t(cfg.durabilityIntervalMs) * 1000000ull;
+    lastSyncTicks_ = getCurrentTicks();
+    unsynced_ = false;
+  }
+#else
+  if (backend_ == minilog::FileBackend_IoUring)
+    backend_ = minilog::FileBackend_Batched;
+#endif // MINILOG_HAS_IO_URING
+
+  if (backend_ == minilog::FileBackend_Batched || backend_ == minilog::FileBackend_IoUring) {
+    stagingSize_ = stagingSize;
+    if (backend_ == minilog::FileBackend_Batched)
+      staging_ = new char[stagingSize_];
+    stagingUsed_ = 0;
+    flushLevel_ = cfg.batchFlushLevel;
+#if OS_WINDOWS
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    flushIntervalTicks_ = uint64_t(frequency.QuadPart) * cfg.batchFlushIntervalMs / 1000;
+#else
+    flushIntervalTicks_ = uint64_t(cfg.batchFlushIntervalMs) * 1000000ull;
+#endif // OS_WINDOWS
+    lastFlushTicks_ = getCurrentTicks();
+  }
+
+  return true;
+}
+
+void LogFile::close() {
+  if (!file_)
+    return;
+
+  flush();
+
+#if !OS_WINDOWS
+  if (mapping_) {
+    munmap(mapping_, mappingSize_);
+    // drop the preallocated tail
+    [[maybe_unused]] const int result = ftruncate(fileno(file_), off_t(cursor_));
+    mapping_ = nullptr;
+    mappingSize_ = 0;
+  }
+#endif // !OS_WINDOWS
+
+#if MINILOG_HAS_IO_URING
+  if (backend_ == minilog::FileBackend_IoUring) {
+    // the staging buffers belong to the ring
+    uring_.close();
+    staging_ = nullptr;
+  }
+#endif // MINILOG_HAS_IO_URING
+
+  fclose(file_);
+
+  file_ = nullptr;
+
+  delete[] staging_;
+
+  staging_ = nullptr;
+  stagingSize_ = 0;
+  stagingUsed_ = 0;
+}
+
+void LogFile::write(const FilePart* parts, uint32_t numParts) {
+  // a failed rotation leaves the file closed
+  if (!file_)
+    return;
+
+  size_t size = 0;
+
+  for (uint32_t i = 0; i != numParts; i++)
+    size += parts[i].size;
+
+  fileSize_ += size;
+
+  if (cfg_.stats)
+    statsBytesWritten.fetch_add(size, std::memory_order_relaxed);
+
+  if (backend_ == minilog::FileBackend_Stdio) {
+    for (uint32_t i = 0; i != numParts; i++)
+      fwrite(parts[i].data, 1, parts[i].size, file_);
+    return;
+  }
+
+  if (backend_ == minilog::FileBackend_Mapped) {
+    if (cursor_ + size > mappingSize_ && !growMapping(cursor_ + size))
+      return;
+    // the kernel owns the dirty pages: once copied, the data survives a crash of this process
+    for (uint32_t i = 0; i != numParts; i++) {
+      memcpy(mapping_ + cursor_, parts[i].data, parts[i].size);
+      cursor_ += parts[i].size;
+    }
+    return;
+  }
+
+#if MINILOG_HAS_IO_URING
+  if (backend_ == minilog::FileBackend_IoUring) {
+    // a message may span two buffers, the offsets keep the file contiguous
+    for (uint32_t i = 0; i != numParts; i++) {
+      const char* data = static_cast<const char*>(parts[i].data);
+      for (size_t left = parts[i].size; left;) {
+        const size_t n = left < stagingSize_ - stagingUsed_ ? left : stagingSize_ - stagingUsed_;
+        memcpy(staging_ + stagingUsed_, data, n);
+        stagingUsed_ += n;
+        data += n;
+        left -= n;
+        if (stagingUsed_ == stagingSize_)
+          submitStaging();
       }
+    }
+    return;
+  }
+#endif // MINILOG_HAS_IO_URING
+
+  if (stagingUsed_ + size <= stagingSize_) {
+    for (uint32_t i = 0; i != numParts; i++) {
+      memcpy(staging_ + stagingUsed_, parts[i].data, parts[i].size);
+      stagingUsed_ += parts[i].size;
+    }
+    return;
+  }
+
+  // the staging buffer is full: submit it together with this message in a single writev()
+#if OS_WINDOWS
+  fwrite(staging_, 1, stagingUsed_, file_);
+  for (uint32_t i = 0; i != numParts; i++)
+    fwrite(parts[i].data, 1, parts[i].size, file_);
+  fflush(file_);
+#else
+  constexpr int kMaxIov = 16;
+  struct iovec iov[kMaxIov];
+  int numIov = 0;
+  if (stagingUsed_)
+    iov[numIov++] = {staging_, stagingUsed_};
+  for (uint32_t i = 0; i != numParts; i++) {
+    if (numIov == kMaxIov) {
+      writeAll(fileno(file_), iov, numIov);
+      numIov = 0;
+    }
+    iov[numIov++] = {const_cast<void*>(parts[i].data), parts[i].size};
+  }
+  writeAll(fileno(file_), iov, numIov);
 #endif // OS_WINDOWS
+
+  countFlush();
+
+  stagingUsed_ = 0;
+  lastFlushTicks_ = getCurrentTicks();
+}
+
+void LogFile::endMessage(minilog::eLogLevel level) {
+  if (!file_)
+    return;
+
+  if (backend_ == minilog::FileBackend_Stdio) {
+    if (forceFlush_) {
+      fflush(file_);
+      countFlush();
+    }
+    return;
+  }
+
+  if (backend_ == minilog::FileBackend_Mapped)
+    return;
+
+  if (level >= flushLevel_)
+    flush();
+  else
+    flushIfDue();
+}
+
+void LogFile::flushIfDue() {
+#if MINILOG_HAS_IO_URING
+  if (file_ && backend_ == minilog::FileBackend_IoUring) {
+    uring_.reap(false);
+    const uint64_t now = getCurrentTicks();
+    const bool syncDue = syncIntervalTicks_ && (unsynced_ || stagingUsed_) && now - lastSyncTicks_ >= syncIntervalTicks_;
+    if (stagingUsed_ && (syncDue || now - lastFlushTicks_ >= flushIntervalTicks_))
+      submitStaging();
+    if (syncDue) {
+      uring_.submitSync();
+      lastSyncTicks_ = now;
+      unsynced_ = false;
     }
+    return;
+  }
+#endif // MINILOG_HAS_IO_URING
+
+  if (!file_ || backend_ != minilog::FileBackend_Batched || !stagingUsed_)
+    return;
+
+  if (getCurrentTicks() - lastFlushTicks_ >= flushIntervalTicks_)
+    flush();
+}
+
+void LogFile::flush() {
+  if (!file_)
+    return;
+
+  if (backend_ == minilog::FileBackend_Stdio) {
+    fflush(file_);
+    countFlush();
+    return;
+  }
+
+  if (backend_ == minilog::FileBackend_Mapped)
+    return;
+
+#if MINILOG_HAS_IO_URING
+  if (backend_ == minilog::FileBackend_IoUring) {
+    if (stagingUsed_)
+      submitStaging();
+    return;
+  }
+#endif // MINILOG_HAS_IO_URING
+
+  if (stagingUsed_) {
+#if OS_WINDOWS
+    fwrite(staging_, 1, stagingUsed_, file_);
+    fflush(file_);
+#else
+    struct iovec iov = {staging_, stagingUsed_};
+    writeAll(fileno(file_), &iov, 1);
+#endif // OS_WINDOWS
+    countFlush();
+  }
+
+  stagingUsed_ = 0;
+  lastFlushTicks_ = getCurrentTicks();
+}
+
+#if MINILOG_HAS_IO_URING
+void LogFile::submitStaging() {
+  uring_.submitWrite(staging_, stagingUsed_);
+  countFlush();
+  staging_ = uring_.acquire();
+  stagingUsed_ = 0;
+  unsynced_ = true;
+  lastFlushTicks_ = getCurrentTicks();
+}
+#endif // MINILOG_HAS_IO_URING
+
+bool LogFile::growMapping(size_t minSize) {
+#if OS_WINDOWS
+  (void)minSize;
+  return false;
+#else
+  const int fd = fileno(file_);
+  const size_t newSize = (minSize + mappingChunk_ - 1) / mappingChunk_ * mappingChunk_;
+
+  if (mapping_)
+    munmap(mapping_, mappingSize_);
+
+  mapping_ = nullptr;
+  mappingSize_ = 0;
+
+  // allocate the disk blocks up front so that a full disk does not SIGBUS us while copying
+#if OS_APPLE
+  if (ftruncate(fd, off_t(newSize)))
+    return false;
+#else
+  if (posix_fallocate(fd, 0, off_t(newSize)) && ftruncate(fd, off_t(newSize)))
+    return false;
+#endif // OS_APPLE
+
+  void* ptr = mmap(nullptr, newSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+  if (ptr == MAP_FAILED)
+    return false;
+
+  mapping_ = static_cast<char*>(ptr);
+  mappingSize_ = newSize;
+
+  return true;
+#endif // OS_WINDOWS
+}
+
+bool LogFile::isRotationDue() const {
+  if (!file_)
+    return false;
+
+  const bool isSizeDue = cfg_.rotateMaxFileSize && fileSize_ >= cfg_.rotateMaxFileSize;
+
+  if (!isSizeDue && !cfg_.rotateIntervalSec)
+    return false;
+
+  const time_t now = time(nullptr);
+
+  if (now == rotateFailedTime_)
+    return false;
+
+  // segments are aligned to wall-clock multiples of the interval (e.g. every hour at HH:00:00 UTC)
+  return isSizeDue || (cfg_.rotateIntervalSec && now / cfg_.rotateIntervalSec != openTime_ / cfg_.rotateIntervalSec);
+}
+
+static bool isFileExisting(const std::string& fileName) {
+  FILE* file = fopen(fileName.c_str(), "rb");
+
+  if (file)
+    fclose(file);
+
+  return file != nullptr;
+}
+
+std::string LogFile::getSegmentName() {
+  // "log.txt" => "log" + ".txt"
+  const size_t slash = fileName_.find_last_of("/\\");
+  const size_t dot = fileName_.rfind('.');
+  const bool hasExt = dot != std::string::npos && (slash == std::string::npos || dot > slash);
+  const std::string stem = hasExt ? fileName_.substr(0, dot) : fileName_;
+  const std::string ext = hasExt ? fileName_.substr(dot) : std::string();
+
+  char tag[64];
+
+  if (cfg_.rotateNaming == minilog::Rotation_TimeStamped) {
+    ::tm tmTime;
+#if OS_WINDOWS
+    localtime_s(&tmTime, &openTime_);
+#else
+    localtime_r(&openTime_, &tmTime);
+#endif
+    strftime(tag, sizeof(tag), "%Y%m%d-%H%M%S", &tmTime);
+    const std::string base = stem + "." + tag;
+    std::string name = base + ext;
+    for (uint32_t i = 1; isFileExisting(name) || isFileExisting(name + ".lz4"); i++)
+      name = base + "-" + std::to_string(i) + ext;
+    return name;
+  }
+
+  for (;;) {
+    snprintf(tag, sizeof(tag), "%u", nextSegmentIndex_++);
+    const std::string name = stem + "." + tag + ext;
+    if (!isFileExisting(name) && !isFileExisting(name + ".lz4"))
+      return name;
+  }
+}
+
+bool LogFile::rotate(const char* footer) {
+  const uint32_t segmentIndex = nextSegmentIndex_;
+  const std::string segmentName = getSegmentName();
+
+#if OS_WINDOWS
+  // an open file cannot be renamed, it is reopened for appending if renaming fails
+  if (footer)
+    write(footer, strlen(footer));
+
+  const uint64_t fileSize = fileSize_;
+  const time_t openTime = openTime_;
+
+  close();
+
+  if (rename(fileName_.c_str(), segmentName.c_str()) != 0) {
+    nextSegmentIndex_ = segmentIndex;
+    rotateFailedTime_ = time(nullptr);
+    if (openFile(true)) {
+      fileSize_ = fileSize;
+      openTime_ = openTime;
+    }
+    return false;
+  }
+#else
+  // the open file is renamed first, nothing is written to it if that fails
+  if (rename(fileName_.c_str(), segmentName.c_str()) != 0) {
+    nextSegmentIndex_ = segmentIndex;
+    rotateFailedTime_ = time(nullptr);
+    return false;
+  }
+
+  if (footer)
+    write(footer, strlen(footer));
+
+  close();
+#endif // OS_WINDOWS
+
+  if (cfg_.rotateCompress)
+    logCompressor.compress(segmentName);
+  segments_.push_back(segmentName);
+
+  while (cfg_.rotateMaxFiles && segments_.size() > cfg_.rotateMaxFiles) {
+    if (cfg_.rotateCompress) {
+      // the compressor thread may still be working on this segment
+      logCompressor.remove(segments_.front());
+    } else {
+      ::remove(segments_.front().c_str());
+    }
+    segments_.pop_front();
+  }
+
+  return openFile(false);
+}
+
+/// LZ4 frame compression of rotated segments (https://github.com/lz4/lz4/blob/dev/doc/lz4_Frame_format.md)
+
+static uint32_t rotl32(uint32_t x, int r) {
+  return (x << r) | (x >> (32 - r));
+}
+
+static uint32_t read32(const uint8_t* p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint32_t xxh32(const uint8_t* p, size_t size, uint32_t seed) {
+  constexpr uint32_t P1 = 2654435761u;
+  constexpr uint32_t P2 = 2246822519u;
+  constexpr uint32_t P3 = 3266489917u;
+  constexpr uint32_t P4 = 668265263u;
+  constexpr uint32_t P5 = 374761393u;
+
+  const uint8_t* end = p + size;
+
+  uint32_t h = 0;
+
+  if (size >= 16) {
+    uint32_t v[4] = {seed + P1 + P2, seed + P2, seed, seed - P1};
+    for (; p + 16 <= end; p += 16)
+      for (int i = 0; i != 4; i++)
+        v[i] = rotl32(v[i] + read32(p + 4 * i) * P2, 13) * P1;
+    h = rotl32(v[0], 1) + rotl32(v[1], 7) + rotl32(v[2], 12) + rotl32(v[3], 18);
+  } else {
+    h = seed + P5;
+  }
+
+  h += uint32_t(size);
+
+  for (; p + 4 <= end; p += 4)
+    h = rotl32(h + read32(p) * P3, 17) * P4;
+  for (; p < end; p++)
+    h = rotl32(h + *p * P5, 11) * P1;
+
+  h ^= h >> 15;
+  h *= P2;
+  h ^= h >> 13;
+  h *= P3;
+  h ^= h >> 16;
+
+  return h;
+}
+
+// greedy LZ4 block compressor, `dst` should hold at least size + size / 255 + 16 bytes
+static size_t compressLZ4Block(const uint8_t* src, size_t size, uint8_t* dst, uint32_t* hashTable, uint32_t hashBits) {
+  const uint8_t* const end = src + size;
+  const uint8_t* const matchStartLimit = size > 12 ? end - 12 : src; // the last match starts at least 12 bytes before the end
+  const uint8_t* const matchEndLimit = size > 12 ? end - 5 : src; // the last 5 bytes are always literals
+
+  const uint8_t* ip = src;
+  const uint8_t* anchor = src;
+
+  uint8_t* out = dst;
+
+  auto writeLength = [&out](size_t length) {
+    for (; length >= 255; length -= 255)
+      *out++ = 255;
+    *out++ = uint8_t(length);
+  };
+
+  memset(hashTable, 0xFF, sizeof(uint32_t) << hashBits);
+
+  while (ip < matchStartLimit) {
+    const uint32_t sequence = read32(ip);
+    const uint32_t hash = (sequence * 2654435761u) >> (32 - hashBits);
+    const uint32_t refPos = hashTable[hash];
+
+    hashTable[hash] = uint32_t(ip - src);
+
+    if (refPos == ~0u || ip - (src + refPos) > 65535 || read32(src + refPos) != sequence) {
+      ip++;
+      continue;
+    }
+
+    const uint8_t* ref = src + refPos;
+    const uint8_t* matchEnd = ip + 4;
+
+    for (ref += 4; matchEnd < matchEndLimit && *matchEnd == *ref; matchEnd++, ref++) {
+    }
+
+    const size_t literals = size_t(ip - anchor);
+    const size_t matchLength = size_t(matchEnd - ip) - 4;
+    const uint16_t offset = uint16_t(ip - (src + refPos));
+
+    *out++ = uint8_t(((literals < 15 ? literals : 15) << 4) | (matchLength < 15 ? matchLength : 15));
+    if (literals >= 15)
+      writeLength(literals - 15);
+    memcpy(out, anchor, literals);
+    out += literals;
+    *out++ = uint8_t(offset & 0xFF);
+    *out++ = uint8_t(offset >> 8);
+    if (matchLength >= 15)
+      writeLength(matchLength - 15);
+
+    ip = matchEnd;
+    anchor = ip;
+  }
+
+  // the last literals
+  const size_t literals = size_t(end - anchor);
+
+  *out++ = uint8_t((literals < 15 ? literals : 15) << 4);
+  if (literals >= 15)
+    writeLength(literals - 15);
+  memcpy(out, anchor, literals);
+  out += literals;
+
+  return size_t(out - dst);
+}
+
+static bool compressFileLZ4(const char* srcFileName, const char* dstFileName) {
+  FILE* src = fopen(srcFileName, "rb");
+
+  if (!src)
+    return false;
+
+  FILE* dst = fopen(dstFileName, "wb");
+
+  if (!dst) {
+    fclose(src);
+    return false;
+  }
+
+  constexpr size_t kBlockSize = 4 * 1024 * 1024;
+  constexpr uint32_t kHashBits = 16;
+
+  std::vector<uint8_t> in(kBlockSize);
+  std::vector<uint8_t> out(kBlockSize + kBlockSize / 255 + 16);
+  std::vector<uint32_t> hashTable(size_t(1) << kHashBits);
+
+  // magic, FLG (version 01, independent blocks), BD (4 Mb blocks), header checksum
+  uint8_t header[7] = {0x04, 0x22, 0x4D, 0x18, 0x60, 0x70, 0};
+  header[6] = uint8_t(xxh32(header + 4, 2, 0) >> 8);
+
+  bool ok = fwrite(header, sizeof(header), 1, dst) == 1;
+
+  while (ok) {
+    const size_t size = fread(in.data(), 1, kBlockSize, src);
+    if (!size)
+      break;
+    size_t compressedSize = compressLZ4Block(in.data(), size, out.data(), hashTable.data(), kHashBits);
+    const uint8_t* data = out.data();
+    uint32_t blockSize = uint32_t(compressedSize);
+    if (compressedSize >= size) {
+      // store incompressible blocks as is
+      data = in.data();
+      compressedSize = size;
+      blockSize = uint32_t(size) | 0x80000000u;
+    }
+    const uint8_t sizeLE[4] = {uint8_t(blockSize), uint8_t(blockSize >> 8), uint8_t(blockSize >> 16), uint8_t(blockSize >> 24)};
+    ok = fwrite(sizeLE, sizeof(sizeLE), 1, dst) == 1 && fwrite(data, 1, compressedSize, dst) == compressedSize;
+  }
+
+  const uint8_t endMark[4] = {};
+
+  ok = ok && !ferror(src) && fwrite(endMark, sizeof(endMark), 1, dst) == 1;
+  ok = fclose(dst) == 0 && ok;
+
+  fclose(src);
+
+  return ok;
+}
+
+void LogCompressor::addTask(const std::string& fileName, bool compress) {
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  if (!thread_.joinable()) {
+    stopRequested_ = false;
+    thread_ = std::thread([this]() { threadProc(); });
+  }
+
+  tasks_.push_back({fileName, compress});
+
+  cv_.notify_one();
+}
+
+void LogCompressor::stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!thread_.joinable())
+      return;
+    stopRequested_ = true;
+    cv_.notify_one();
+  }
+
+  thread_.join();
+}
+
+void FlushTimer::start(uint32_t intervalMs) {
+  // wake up twice per interval, so nothing stays staged much longer than the interval
+  intervalMs_ = intervalMs / 2 ? intervalMs / 2 : 1;
+  stopRequested_ = false;
+  thread_ = std::thread([this]() { threadProc(); });
+}
+
+void FlushTimer::stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!thread_.joinable())
+      return;
+    stopRequested_ = true;
+    cv_.notify_one();
+  }
+
+  thread_.join();
+}
+
+void FlushTimer::threadProc() {
+  minilog::threadNameSet("minilog-flush");
+
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (cv_.wait_for(lock, std::chrono::milliseconds(intervalMs_), [this]() { return stopRequested_; }))
+        return;
+    }
+    std::lock_guard<std::mutex> lock(logMutex);
+    logFile.flushIfDue();
+  }
+}
+
+void LogCompressor::threadProc() {
+  minilog::threadNameSet("minilog-compressor");
+
+  for (;;) {
+    Task task;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [this]() { return stopRequested_ || !tasks_.empty(); });
+      if (tasks_.empty())
+        return;
+      task = std::move(tasks_.front());
+      tasks_.pop_front();
+    }
+    const std::string compressedName = task.fileName + ".lz4";
+    if (task.compress) {
+      if (compressFileLZ4(task.fileName.c_str(), compressedName.c_str()))
+        ::remove(task.fileName.c_str());
+      else
+        ::remove(compressedName.c_str());
+    } else {
+      ::remove(task.fileName.c_str());
+      ::remove(compressedName.c_str());
+    }
+  }
+}
+
+// LogConfig::callstackMaxDepth: the outermost proc written into messages
+static uint32_t getFirstWrittenProc(const ThreadLogContext* ctx) {
+  const uint32_t level = ctx->procsNestingLevel;
+
+  return config.callstackMaxDepth && level > config.callstackMaxDepth ? level - config.callstackMaxDepth : 0;
+}
+
+// writes "[category] " (if any) and the callstack
+static char* writeCurrentProcsNesting(char* buffer, const char* bufferEnd, const minilog::Category* category) {
+  ThreadLogContext* ctx = getThreadLogContext();
+
+  if (category) {
+    const size_t len = strlen(category->name);
+    if (buffer + len + 3 < bufferEnd) {
+      *buffer++ = '[';
+      memcpy(buffer, category->name, len);
+      buffer += len;
+      *buffer++ = ']';
+      *buffer++ = ' ';
+    }
+  }
+
+  uint32_t level = ctx->procsNestingLevel;
+  const uint32_t first = buffer + 3 < bufferEnd ? getFirstWrittenProc(ctx) : 0;
+
+  // LogConfig::callstackMaxDepth: "..." followed by the deepest procs
+  if (first) {
+    memcpy(buffer, "...", 3);
+    buffer += 3;
+  }
+
+  // only whole procs
+  while (level > first && ctx->procsPrefixLength[level] - ctx->procsPrefixLength[first] >= size_t(bufferEnd - buffer))
+    level--;
+
+  const uint32_t len = ctx->procsPrefixLength[level] - ctx->procsPrefixLength[first];
+  memcpy(buffer, ctx->procsPrefix + ctx->procsPrefixLength[first], len);
+
+  return buffer + len;
+}
+
+/// message details: JSON and binary outputs get the category, callstack and fields as data
+
+// [uint8_t elided][category name][0] followed by the procs written into messages, each 0-terminated; an upper bound
+static size_t getCallstackDataSize(const minilog::Category* category, const ThreadLogContext* ctx) {
+  const uint32_t first = getFirstWrittenProc(ctx);
+  const uint32_t level = ctx->procsNestingLevel;
+
+  return 2 + (category ? strlen(category->name) : 0) + ctx->procsPrefixLength[level] - ctx->procsPrefixLength[first] + level - first;
+}
+
+// `elided` is set when LogConfig::callstackMaxDepth left out the outermost procs
+static char* writeCallstackData(char* out, const minilog::Category* category, const ThreadLogContext* ctx) {
+  const uint32_t first = getFirstWrittenProc(ctx);
+
+  *out++ = first ? 1 : 0;
+
+  if (category) {
+    const size_t length = strlen(category->name);
+    memcpy(out, category->name, length);
+    out += length;
+  }
+  *out++ = 0;
+
+  // procs which did not fit into ThreadLogContext::procsPrefix are not in the text either
+  for (uint32_t i = first; i != ctx->procsNestingLevel; i++) {
+    const uint32_t length = ctx->procsPrefixLength[i + 1] - ctx->procsPrefixLength[i];
+    if (!length)
+      continue;
+    memcpy(out, ctx->procsPrefix + ctx->procsPrefixLength[i], length);
+    out += length;
+    *out++ = 0;
+  }
+
+  return out;
+}
+
+// every field is [uint8_t eType][key][0] followed by the value: 8 bytes, 1 byte for Type_Bool, uint32_t length and the
+// bytes for Type_String
+static size_t getFieldsDataSize(FieldList fields) {
+  size_t size = 0;
+
+  for (const minilog::Field& f : fields) {
+    const size_t valueSize = f.type == minilog::Field::Type_String ? sizeof(uint32_t) + f.value.str.length
+                             : f.type == minilog::Field::Type_Bool ? 1
+                                                                   : 8;
+    size += 2 + strlen(f.key) + valueSize;
+  }
+
+  return size;
+}
+
+static char* writeFieldsData(char* out, FieldList fields) {
+  for (const minilog::Field& f : fields) {
+    *out++ = char(f.type);
+    const size_t keySize = strlen(f.key) + 1;
+    memcpy(out, f.key, keySize);
+    out += keySize;
+    switch (f.type) {
+    case minilog::Field::Type_Bool:
+      *out++ = f.value.b ? 1 : 0;
+      break;
+    case minilog::Field::Type_String: {
+      const uint32_t length = uint32_t(f.value.str.length);
+      memcpy(out, &length, sizeof(length));
+      memcpy(out + sizeof(length), f.value.str.s, length);
+      out += sizeof(length) + length;
+      break;
+    }
+    default:
+      // all other values are 8 bytes long
+      memcpy(out, &f.value, 8);
+      out += 8;
+      break;
+    }
+  }
+
+  return out;
+}
+
+// the reverse of writeFieldsData(), the key and string values of `f` point into `data`; nullptr if the data is malformed
+static const char* readField(const char* data, const char* dataEnd, minilog::Field& f) {
+  if (data == dataEnd || uint8_t(*data) > minilog::Field::Type_String)
+    return nullptr;
+
+  f.type = minilog::Field::eType(*data++);
+  f.key = data;
+
+  const char* keyEnd = static_cast<const char*>(memchr(data, 0, size_t(dataEnd - data)));
+  if (!keyEnd)
+    return nullptr;
+  data = keyEnd + 1;
+
+  switch (f.type) {
+  case minilog::Field::Type_Bool:
+    if (data == dataEnd)
+      return nullptr;
+    f.value.b = *data++ != 0;
+    break;
+  case minilog::Field::Type_String: {
+    uint32_t length;
+    if (dataEnd - data < ptrdiff_t(sizeof(length)))
+      return nullptr;
+    memcpy(&length, data, sizeof(length));
+    data += sizeof(length);
+    if (size_t(dataEnd - data) < length)
+      return nullptr;
+    f.value.str.s = data;
+    f.value.str.length = length;
+    data += length;
+    break;
+  }
+  default:
+    if (dataEnd - data < 8)
+      return nullptr;
+    memcpy(&f.value, data, 8);
+    data += 8;
+    break;
+  }
+
+  return data;
+}
+
+// a JSON value: strings are quoted and escaped, everything else is a literal (JSON has no NaN and infinities)
+static char* writeFieldValue(char* out, const char* end, const minilog::Field& f) {
+  switch (f.type) {
+  case minilog::Field::Type_Signed:
+    return writeInteger(out, end, f.value.i < 0 ? 0ull - uint64_t(f.value.i) : uint64_t(f.value.i), f.value.i < 0);
+  case minilog::Field::Type_Unsigned:
+    return writeInteger(out, end, f.value.u, false);
+  case minilog::Field::Type_Double:
+    if (f.value.d - f.value.d == 0.0) {
+      const int length = snprintf(out, size_t(end - out) + 1, "%.15g", f.value.d);
+      return length > 0 && length <= end - out ? out + length : out;
+    }
+    return copyString(out, end, "null");
+  case minilog::Field::Type_Bool:
+    return copyString(out, end, f.value.b ? "true" : "false");
+  case minilog::Field::Type_String:
+    return writeJSONString(out, end, f.value.str.s, f.value.str.length);
+  }
+
+  return out;
+}
+
+static size_t getMessageDetailsSize(const minilog::Category* category, const ThreadLogContext* ctx, FieldList fields) {
+  return sizeof(MessageDetails) + getCallstackDataSize(category, ctx) + getFieldsDataSize(fields);
+}
+
+// `out` should have getMessageDetailsSize() bytes, returns the end of the block
+static char* writeMessageDetails(char* out,
+                                 size_t msgLength,
+                                 const minilog::Category* category,
+                                 const ThreadLogContext* ctx,
+                                 FieldList fields) {
+  char* callstack = out + sizeof(MessageDetails);
+  char* fieldsData = writeCallstackData(callstack, category, ctx);
+  char* end = writeFieldsData(fieldsData, fields);
+
+  MessageDetails d;
+  d.size = uint32_t(end - out);
+  d.msgLength = fields.size() ? uint32_t(msgLength) : 0;
+  d.callstackSize = uint32_t(fieldsData - callstack);
+  d.numFields = uint32_t(fields.size());
+  memcpy(out, &d, sizeof(d));
+
+  return end;
+}
+
+// the block is not aligned
+static MessageDetails getMessageDetails(const char* details) {
+  MessageDetails d;
+  memcpy(&d, details, sizeof(d));
+  return d;
+}
+
+/// deferred formatting: printf-style arguments are captured as raw bytes and formatted later
+
+enum eArgLength { ArgLength_None, ArgLength_hh, ArgLength_h, ArgLength_l, ArgLength_ll, ArgLength_j, ArgLength_z, ArgLength_t, ArgLength_L };
+
+// a printf conversion specification, i.e. everything after '%'
+struct FormatSpec {
+  const char* flags = nullptr;
+  uint32_t flagsLength = 0;
+  const char* width = nullptr;
+  uint32_t widthLength = 0;
+  bool widthStar = false;
+  bool hasPrecision = false;
+  const char* precision = nullptr;
+  uint32_t precisionLength = 0;
+  bool precisionStar = false;
+  eArgLength length = ArgLength_None;
+  char conversion = 0;
+};
+
+static bool isDigit(char c) {
+  return c >= '0' && c <= '9';
+}
+
+// returns a pointer past the specification or nullptr if it cannot be captured (%n, wide chars and strings, malformed)
+static const char* parseFormatSpec(const char* p, FormatSpec& spec) {
+  spec = FormatSpec();
+
+  spec.flags = p;
+  while (*p == '-' || *p == '+' || *p == ' ' || *p == '#' || *p == '0' || *p == '\'')
+    p++;
+  spec.flagsLength = uint32_t(p - spec.flags);
+
+  if (*p == '*') {
+    spec.widthStar = true;
+    p++;
+  } else {
+    spec.width = p;
+    while (isDigit(*p))
+      p++;
+    spec.widthLength = uint32_t(p - spec.width);
+  }
+
+  if (*p == '.') {
+    spec.hasPrecision = true;
+    p++;
+    if (*p == '*') {
+      spec.precisionStar = true;
+      p++;
+    } else {
+      spec.precision = p;
+      while (isDigit(*p))
+        p++;
+      spec.precisionLength = uint32_t(p - spec.precision);
+    }
+  }
+
+  switch (*p) {
+  case 'h':
+    p++;
+    spec.length = *p == 'h' ? (p++, ArgLength_hh) : ArgLength_h;
+    break;
+  case 'l':
+    p++;
+    spec.length = *p == 'l' ? (p++, ArgLength_ll) : ArgLength_l;
+    break;
+  case 'q':
+    p++;
+    spec.length = ArgLength_ll;
+    break;
+  case 'j':
+    p++;
+    spec.length = ArgLength_j;
+    break;
+  case 'z':
+    p++;
+    spec.length = ArgLength_z;
+    break;
+  case 't':
+    p++;
+    spec.length = ArgLength_t;
+    break;
+  case 'L':
+    p++;
+    spec.length = ArgLength_L;
+    break;
+  }
+
+  spec.conversion = *p;
+
+  switch (spec.conversion) {
+  case 'c':
+  case 's':
+    if (spec.length == ArgLength_l)
+      return nullptr;
+    break;
+  case 'd':
+  case 'i':
+  case 'u':
+  case 'o':
+  case 'x':
+  case 'X':
+  case 'p':
+  case 'f':
+  case 'F':
+  case 'e':
+  case 'E':
+  case 'g':
+  case 'G':
+  case 'a':
+  case 'A':
+  case '%':
+    break;
+  default:
+    return nullptr;
+  }
+
+  return p + 1;
+}
+
+static uint32_t parseUInt(const char* p, uint32_t length) {
+  uint32_t v = 0;
+  for (uint32_t i = 0; i != length; i++)
+    v = v * 10 + uint32_t(p[i] - '0');
+  return v;
+}
+
+// Captures all arguments referenced by `format` into `out`: integers are widened to 64 bits, strings are copied inline.
+// Returns the number of bytes written or -1 if the arguments cannot be captured (then nothing was consumed from `args`).
+static int captureFormatArgs(uint8_t* out, const uint8_t* outEnd, const char* format, va_list args) {
+  uint8_t* cur = out;
+
+  auto put = [&cur, outEnd](const void* data, size_t size) -> bool {
+    if (size > size_t(outEnd - cur))
+      return false;
+    memcpy(cur, data, size);
+    cur += size;
+    return true;
+  };
+
+  // validate everything before touching `args`
+  for (const char* p = format; *p;) {
+    if (*p++ != '%')
+      continue;
+    FormatSpec spec;
+    p = parseFormatSpec(p, spec);
+    if (!p)
+      return -1;
+  }
+
+  for (const char* p = format; *p;) {
+    if (*p++ != '%')
+      continue;
+
+    FormatSpec spec;
+    p = parseFormatSpec(p, spec);
+
+    if (spec.conversion == '%')
+      continue;
+
+    int32_t precision = spec.hasPrecision ? int32_t(parseUInt(spec.precision, spec.precisionLength)) : -1;
+
+    if (spec.widthStar) {
+      const int32_t v = va_arg(args, int);
+      if (!put(&v, sizeof(v)))
+        return -1;
+    }
+    if (spec.precisionStar) {
+      precision = va_arg(args, int);
+      if (!put(&precision, sizeof(precision)))
+        return -1;
+    }
+
+    bool ok = true;
+
+    switch (spec.conversion) {
+    case 'd':
+    case 'i': {
+      int64_t v = 0;
+      switch (spec.length) {
+      case ArgLength_hh:
+        v = (signed char)va_arg(args, int);
+        break;
+      case ArgLength_h:
+        v = (short)va_arg(args, int);
+        break;
+      case ArgLength_l:
+        v = va_arg(args, long);
+        break;
+      case ArgLength_ll:
+      case ArgLength_L:
+        v = va_arg(args, long long);
+        break;
+      case ArgLength_j:
+        v = va_arg(args, intmax_t);
+        break;
+      case ArgLength_z:
+        v = int64_t(va_arg(args, size_t));
+        break;
+      case ArgLength_t:
+        v = va_arg(args, ptrdiff_t);
+        break;
+      case ArgLength_None:
+        v = va_arg(args, int);
+        break;
+      }
+      ok = put(&v, sizeof(v));
+      break;
+    }
+    case 'u':
+    case 'o':
+    case 'x':
+    case 'X': {
+      uint64_t v = 0;
+      switch (spec.length) {
+      case ArgLength_hh:
+        v = (unsigned char)va_arg(args, unsigned int);
+        break;
+      case ArgLength_h:
+        v = (unsigned short)va_arg(args, unsigned int);
+        break;
+      case ArgLength_l:
+        v = va_arg(args, unsigned long);
+        break;
+      case ArgLength_ll:
+      case ArgLength_L:
+        v = va_arg(args, unsigned long long);
+        break;
+      case ArgLength_j:
+        v = va_arg(args, uintmax_t);
+        break;
+      case ArgLength_z:
+        v = va_arg(args, size_t);
+        break;
+      case ArgLength_t:
+        v = uint64_t(va_arg(args, ptrdiff_t));
+        break;
+      case ArgLength_None:
+        v = va_arg(args, unsigned int);
+        break;
+      }
+      ok = put(&v, sizeof(v));
+      break;
+    }
+    case 'c': {
+      const int32_t v = va_arg(args, int);
+      ok = put(&v, sizeof(v));
+      break;
+    }
+    case 'p': {
+      const uint64_t v = uint64_t(uintptr_t(va_arg(args, void*)));
+      ok = put(&v, sizeof(v));
+      break;
+    }
+    case 's': {
+      const char* str = va_arg(args, const char*);
+      if (!str)
+        str = "(null)";
+      const uint32_t len = uint32_t(precision >= 0 ? strnlen(str, size_t(precision)) : strlen(str));
+      const char zero = 0;
+      ok = put(&len, sizeof(len)) && put(str, len) && put(&zero, 1);
+      break;
+    }
+    default:
+      if (spec.length == ArgLength_L) {
+        const long double v = va_arg(args, long double);
+        ok = put(&v, sizeof(v));
+      } else {
+        const double v = va_arg(args, double);
+        ok = put(&v, sizeof(v));
+      }
+      break;
+    }
+
+    if (!ok)
+      return -1;
+  }
+
+  return int(cur - out);
+}
+
+// Formats `format` using arguments captured by captureFormatArgs(); returns the end of the written text (always 0-terminated).
+static char* formatCapturedArgs(char* buffer, const char* bufferEnd, const char* format, const uint8_t* args, const uint8_t* argsEnd) {
+  char* out = buffer;
+
+  auto get = [&args, argsEnd](void* data, size_t size) {
+    if (size > size_t(argsEnd - args)) {
+      memset(data, 0, size);
+      return;
+    }
+    memcpy(data, args, size);
+    args += size;
+  };
+
+  for (const char* p = format; *p && out < bufferEnd;) {
+    if (*p != '%') {
+      *out++ = *p++;
+      continue;
+    }
+
+    FormatSpec spec;
+    p = parseFormatSpec(p + 1, spec);
+
+    if (!p)
+      break;
+
+    if (spec.conversion == '%') {
+      *out++ = '%';
+      continue;
+    }
+
+    // rebuild the specification with star arguments resolved and a length modifier matching the captured type
+    char specStr[64];
+    char* s = specStr;
+    *s++ = '%';
+    memcpy(s, spec.flags, spec.flagsLength);
+    s += spec.flagsLength;
+    if (spec.widthStar) {
+      int32_t width = 0;
+      get(&width, sizeof(width));
+      s += snprintf(s, 16, "%d", width);
+    } else {
+      memcpy(s, spec.width, spec.widthLength);
+      s += spec.widthLength;
+    }
+    if (spec.precisionStar) {
+      int32_t precision = 0;
+      get(&precision, sizeof(precision));
+      if (precision >= 0)
+        s += snprintf(s, 16, ".%d", precision);
+    } else if (spec.hasPrecision) {
+      *s++ = '.';
+      memcpy(s, spec.precision, spec.precisionLength);
+      s += spec.precisionLength;
+    }
+
+    const size_t size = size_t(bufferEnd - out) + 1;
+    int n = 0;
+
+    switch (spec.conversion) {
+    case 'd':
+    case 'i': {
+      int64_t v = 0;
+      get(&v, sizeof(v));
+      *s++ = 'l';
+      *s++ = 'l';
+      *s++ = spec.conversion;
+      *s = 0;
+      n = snprintf(out, size, specStr, (long long)v);
+      break;
+    }
+    case 'u':
+    case 'o':
+    case 'x':
+    case 'X': {
+      uint64_t v = 0;
+      get(&v, sizeof(v));
+      *s++ = 'l';
+      *s++ = 'l';
+      *s++ = spec.conversion;
+      *s = 0;
+      n = snprintf(out, size, specStr, (unsigned long long)v);
+      break;
+    }
+    case 'c': {
+      int32_t v = 0;
+      get(&v, sizeof(v));
+      *s++ = 'c';
+      *s = 0;
+      n = snprintf(out, size, specStr, int(v));
+      break;
+    }
+    case 'p': {
+      uint64_t v = 0;
+      get(&v, sizeof(v));
+      *s++ = 'p';
+      *s = 0;
+      n = snprintf(out, size, specStr, (void*)uintptr_t(v));
+      break;
+    }
+    case 's': {
+      uint32_t len = 0;
+      get(&len, sizeof(len));
+      const char* str = reinterpret_cast<const char*>(args);
+      if (size_t(argsEnd - args) < size_t(len) + 1)
+        return out;
+      args += len + 1;
+      *s++ = 's';
+      *s = 0;
+      n = snprintf(out, size, specStr, str);
+      break;
+    }
+    default:
+      if (spec.length == ArgLength_L) {
+        long double v = 0;
+        get(&v, sizeof(v));
+        *s++ = 'L';
+        *s++ = spec.conversion;
+        *s = 0;
+        n = snprintf(out, size, specStr, v);
+      } else {
+        double v = 0;
+        get(&v, sizeof(v));
+        *s++ = spec.conversion;
+        *s = 0;
+        n = snprintf(out, size, specStr, v);
+      }
+      break;
+    }
+
+    if (n > 0)
+      out += size_t(n) < size ? size_t(n) : size - 1;
+  }
+
+  *out = 0;
+
+  return out;
+}
+
+/// binary log file
+
+void BinaryLogWriter::begin(LogFile& file) {
+  formatIds_.clear();
+  formats_.clear();
+  callstackIds_.clear();
+  threads_.clear();
+  numThreads_ = 0;
+
+  FileHeader header = {};
+  memcpy(header.magic, kMagic, sizeof(header.magic));
+  header.version = kVersion;
+  header.byteOrderMark = 0x01020304;
+  header.timeStampPrecision = uint32_t(config.timeStampPrecision);
+
+  file.write(&header, sizeof(header));
+}
+
+void BinaryLogWriter::writeString(LogFile& file, eChunk chunk, uint32_t id, const char* str, uint32_t length) {
+  const uint32_t data[2] = {id, length};
+  const FilePart parts[] = {{&chunk, 1}, {data, sizeof(data)}, {str, length}};
+
+  file.write(parts, 3);
+}
+
+uint32_t BinaryLogWriter::internFormat(LogFile& file, const char* format) {
+  auto i = formatIds_.find(format);
+
+  // the same pointer can be reused for a different format string if it is not a literal
+  if (i != formatIds_.end() && formats_[i->second] == format)
+    return i->second;
+
+  const uint32_t id = uint32_t(formats_.size());
+
+  formats_.emplace_back(format);
+  formatIds_[format] = id;
+  writeString(file, Chunk_Format, id, format, uint32_t(formats_.back().size()));
+
+  return id;
+}
+
+uint32_t BinaryLogWriter::internCallstack(LogFile& file, const char* callstack, uint32_t length) {
+  callstackKey_.assign(callstack, length);
+
+  auto i = callstackIds_.find(callstackKey_);
+
+  if (i != callstackIds_.end())
+    return i->second;
+
+  const uint32_t id = uint32_t(callstackIds_.size());
+
+  callstackIds_.emplace(callstackKey_, id);
+  writeString(file, Chunk_Callstack, id, callstack, length);
+
+  return id;
+}
+
+uint32_t BinaryLogWriter::internThread(LogFile& file, const LogMessage& m) {
+  if (m.threadIndex >= threads_.size())
+    threads_.resize(m.threadIndex + 1, {nullptr, 0, ~0u});
+
+  ThreadEntry& e = threads_[m.threadIndex];
+
+  // names are interned, comparing pointers is enough
+  if (e.index != ~0u && e.name == m.threadName && e.id == m.threadId)
+    return e.index;
+
+  // a new thread or a renamed one
+  const char* name = m.threadName;
+  const uint64_t id = m.threadId;
+  const uint32_t index = numThreads_++;
+
+  e = {name, id, index};
+
+  const eChunk chunk = Chunk_Thread;
+  const uint32_t length = name ? uint32_t(strlen(name)) : ~0u;
+  const uint32_t data[2] = {index, length};
+  const FilePart parts[] = {{&chunk, 1}, {data, sizeof(data)}, {&id, sizeof(id)}, {name, name ? length : 0}};
+
+  file.write(parts, name ? 4 : 3);
+
+  return index;
+}
+
+void BinaryLogWriter::write(LogFile& file, const LogMessage& m) {
+  CapturedMessage preformatted;
+
+  const CapturedMessage* captured = m.captured;
+
+  if (!captured) {
+    // a message which was formatted right away goes as "%s"
+    preformatted.timeStamp = m.timeStamp;
+    preformatted.raw = m.msg == m.text;
+    preformatted.callstack = m.callstack;
+    preformatted.callstackLength = m.callstack ? uint32_t(m.msg - m.callstack) : 0;
+    preformatted.format = "%s";
+    captured = &preformatted;
+  }
+
+  MessageDetails d = {};
+  std::string callstackText;
+  const char* callstack = nullptr;
+  const char* fields = nullptr;
+  uint32_t fieldsSize = 0;
+
+  if (m.details) {
+    d = getMessageDetails(m.details);
+    callstack = m.details + sizeof(MessageDetails);
+    fields = callstack + d.callstackSize;
+    fieldsSize = d.numFields ? uint32_t(m.details + d.size - fields) : 0;
+  } else {
+    // the callstack of a message logged before the binary output was added is kept as a single proc
+    callstackText.assign(2, 0);
+    if (captured->callstackLength) {
+      callstackText.append(captured->callstack, captured->callstackLength);
+      callstackText.push_back(0);
+    }
+    callstack = callstackText.data();
+    d.callstackSize = uint32_t(callstackText.size());
+  }
+
+  MessageRecord rec = {};
+  rec.timeStamp = captured->timeStamp;
+  rec.formatId = internFormat(file, captured->format);
+  rec.callstackId = internCallstack(file, callstack, d.callstackSize);
+  rec.threadIndex = internThread(file, m);
+  rec.level = uint8_t(m.level);
+  rec.flags = (captured->raw ? Flag_Raw : 0) | (m.printToConsole ? Flag_PrintToConsole : 0) | (m.categorized ? Flag_Categorized : 0) |
+              (m.backtrace ? Flag_Backtrace : 0) | (d.numFields ? Flag_Structured : 0);
+
+  const eChunk chunk = Chunk_Message;
+  const uint32_t length = m.captured ? 0 : uint32_t(d.numFields ? d.msgLength : strlen(m.msg));
+  const uint32_t argsSize = m.captured ? captured->argsSize
+                                       : uint32_t(sizeof(length) + length + 1 + (d.numFields ? sizeof(d.numFields) + fieldsSize : 0));
+
+  FilePart parts[8];
+  uint32_t numParts = 0;
+
+  parts[numParts++] = {&chunk, 1};
+  parts[numParts++] = {&rec, sizeof(rec)};
+
+  if (argsSize > UINT16_MAX) {
+    rec.flags |= Flag_LongArgs;
+    parts[numParts++] = {&argsSize, sizeof(argsSize)};
+  } else {
+    rec.argsSize = uint16_t(argsSize);
+  }
+
+  if (m.captured) {
+    parts[numParts++] = {captured->args, captured->argsSize};
+  } else {
+    parts[numParts++] = {&length, sizeof(length)};
+    parts[numParts++] = {m.msg, length};
+    parts[numParts++] = {"", 1};
+    if (d.numFields) {
+      parts[numParts++] = {&d.numFields, sizeof(d.numFields)};
+      parts[numParts++] = {fields, fieldsSize};
+    }
+  }
+
+  file.write(parts, numParts);
+}
+
+static const char* kHTMLPrefix[] = {
+    "<div id=\"p1\">", // Paranoid
+    "<div id=\"p2\">", // Paranoid
+    "<div id=\"l1\">", // Debug
+    "<div id=\"l2\">", // Debug
+    "<div id=\"l1\">", // Log
+    "<div id=\"l2\">", // Log
+    "<div id=\"w1\">", // Warning
+    "<div id=\"w2\">", // Warning
+    "<div id=\"w1\">", // FatalError
+    "<div id=\"w2\">" // FatalError
+};
+
+static constexpr uint32_t kMaxLineParts = 6;
+
+// the buffer size writeJSONLine() needs for `m`: JSON escaping can make a string up to 6 times longer, every field value
+// takes at most 6 times its size in MessageDetails
+static size_t getJSONLineLength(const LogMessage& m) {
+  const size_t detailsSize = m.details ? getMessageDetails(m.details).size : 0;
+
+  return 6 * (strlen(m.text) + detailsSize + (m.threadName ? strlen(m.threadName) : 0)) + 256;
+}
+
+// splits a line of the text or HTML log into parts; `threadId` should hold 24 chars, `mainThread` is interned
+static uint32_t getLineParts(const LogMessage& m, bool html, bool threadNames, const char* mainThread, FilePart* parts, char* threadId) {
+  uint32_t numParts = 0;
+
+  auto addPart = [parts, &numParts](const char* str, size_t size) { parts[numParts++] = {str, size}; };
+
+  if (html) {
+    const int threadID = threadNames && m.threadName && m.threadName != mainThread ? 1 : 0;
+    const char* prefix = kHTMLPrefix[2 * m.level + threadID];
+    addPart(prefix, strlen(prefix));
+  }
+
+  if (threadNames) {
+    if (m.threadName) {
+      addPart("(", 1);
+      addPart(m.threadName, strlen(m.threadName));
+    } else {
+      addPart(threadId, size_t(snprintf(threadId, 24, "(%llu", (unsigned long long)m.threadId)));
+    }
+    addPart("):", 2);
+  }
+
+  addPart(m.text, strlen(m.text));
+
+  if (html)
+    addPart("</div>\n", 7);
+  else
+    addPart("\n", 1);
+
+  return numParts;
+}
+
+// one line of the text, HTML or JSON Lines log; `jsonLine` is the buffer for writeJSONLine()
+static void writeLogLine(LogFile& file,
+                         const LogMessage& m,
+                         const minilog::LogConfig& cfg,
+                         const char* mainThread,
+                         std::vector<char>& jsonLine) {
+  if (cfg.jsonLog) {
+    if (jsonLine.size() < getJSONLineLength(m))
+      jsonLine.resize(getJSONLineLength(m));
+    const char* end = writeJSONLine(jsonLine.data(), jsonLine.data() + jsonLine.size(), m, cfg.timeStampPrecision);
+    file.write(jsonLine.data(), size_t(end - jsonLine.data()));
+    if (jsonLine.size() > 1024 * 1024)
+      std::vector<char>().swap(jsonLine);
+    return;
+  }
+
+  char threadId[24];
+  FilePart parts[kMaxLineParts];
+
+  const uint32_t numParts = getLineParts(m, cfg.htmlLog, cfg.threadNames, mainThread, parts, threadId);
+
+  file.write(parts, numParts);
+}
+
+static void rotateLogFile() {
+  // every segment is a complete log file on its own
+  const bool html = config.htmlLog && !config.binaryLog && !config.jsonLog;
+
+  if (!logFile.rotate(html ? getHTMLOutro(config.htmlPageFooter) : nullptr))
+    return;
+
+  if (config.binaryLog)
+    binaryLogWriter.begin(logFile);
+  else if (config.htmlLog && !config.jsonLog)
+    writeHTMLIntro(config.htmlPageTitle, config.htmlPageHeader);
+}
+
+static void writeMessageToLog(const LogMessage& m) {
+  const minilog::eLogLevel level = m.level;
+
+#if OS_ANDROID
+  const char* msg = m.text;
+  if (m.threadName)
+    __android_log_print(ANDROID_LOG_INFO, "minilog", "(%s):%s", m.threadName, msg);
+  else
+    __android_log_print(ANDROID_LOG_INFO, "minilog", "(%llu):%s", (unsigned long long)m.threadId, msg);
+#endif
+
+  if (!logFile.isOpen())
+    return;
+
+  if (logFile.isRotationDue()) {
+    rotateLogFile();
+    // the file could not be renamed or reopened
+    if (!logFile.isOpen())
+      return;
+  }
+
+  if (config.binaryLog) {
+    binaryLogWriter.write(logFile, m);
+    logFile.endMessage(level);
+    return;
+  }
+
+  static std::vector<char> jsonLine; // guarded by logMutex
+
+  writeLogLine(logFile, m, config, mainThreadName, jsonLine);
+  logFile.endMessage(level);
+}
+
+void minilog::threadNameSet(const char* name) {
+  ThreadLogContext* ctx = getThreadLogContext();
+
+  ctx->threadName = threadNameRegistry.intern(name);
+
+  if (ctx->profilerBuffer && ctx->profilerGeneration == profilerGeneration.load(std::memory_order_relaxed))
+    ctx->profilerBuffer->setThreadName(ctx->threadName);
+}
+
+const char* minilog::threadNameGet() {
+  ThreadLogContext* ctx = getThreadLogContext();
+
+  return ctx->threadName ? ctx->threadName : "";
+}
+
+static void printMessageToConsole(const LogMessage& m, minilog::eLogLevel minLevel) {
+  if (m.level < minLevel)
+    return;
+
+#if OS_APPLE
+  if (config.coloredConsole) {
+    const minilog::eLogLevel level = m.level;
+    if (config.threadNames) {
+      if (m.threadName) {
+        os_log_with_type(OS_LOG_DEFAULT, logLevelToOsLogType(level), "(%{public}s):%{public}s", m.threadName, m.text);
+      } else {
+        os_log_with_type(OS_LOG_DEFAULT, logLevelToOsLogType(level), "(%{public}llu):%{public}s", (unsigned long long)m.threadId, m.text);
+      }
+    } else {
+      os_log_with_type(OS_LOG_DEFAULT, logLevelToOsLogType(level), "%{public}s", m.text);
+    }
+  }
+#endif // OS_APPLE
+
+  consoleWriter.print(m);
+}
+
+void ConsoleWriter::start(const minilog::LogConfig& cfg) {
+  stagingSize_ = 0;
+  batchDepth_ = 0;
+  numDropped_ = 0;
+
+  // escape sequences are not written into pipes and files
+#if OS_WINDOWS
+#  if !defined(ENABLE_VIRTUAL_TERMINAL_PROCESSING)
+#    define ENABLE_VIRTUAL_TERMINAL_PROCESSING 0x0004
+#  endif
+  colors_ = false;
+  if (cfg.coloredConsole && _isatty(_fileno(stdout))) {
+    HANDLE console = GetStdHandle(STD_OUTPUT_HANDLE);
+    DWORD mode = 0;
+    colors_ = GetConsoleMode(console, &mode) && SetConsoleMode(console, mode | ENABLE_VIRTUAL_TERMINAL_PROCESSING);
+  }
+#else
+  colors_ = cfg.coloredConsole && isatty(STDOUT_FILENO);
+#endif // OS_WINDOWS
+
+  if (cfg.consoleThread) {
+    queueCapacity_ = cfg.consoleQueueSize > kStagingSize ? cfg.consoleQueueSize : kStagingSize;
+    queue_.clear();
+    queue_.reserve(queueCapacity_);
+    queueSize_.store(0, std::memory_order_relaxed);
+    stopRequested_ = false;
+    thread_ = std::thread([this]() { threadProc(); });
+  }
+}
+
+void ConsoleWriter::stop() {
+  {
+    std::lock_guard<std::mutex> lock(logMutex);
+    flush();
+  }
+
+  if (!thread_.joinable())
+    return;
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopRequested_ = true;
+  }
+  cv_.notify_one();
+  thread_.join();
+}
+
+void ConsoleWriter::print(const LogMessage& m) {
+  // ANSI colors for all terminals, Windows 10+ included
+  static const char* const kColors[] = {"\033[0;90m", "\033[0m", "\033[1m", "\033[1;33m", "\033[1;31m"};
+  static const char kReset[] = "\033[0m";
+
+  const char* color = colors_ ? kColors[m.level] : "";
+  const size_t colorLength = strlen(color);
+  const size_t textLength = strlen(m.text);
+
+  char threadId[24];
+  const char* threadName = m.threadName;
+  size_t threadNameLength = 0;
+  if (config.threadNames) {
+    if (!threadName) {
+      threadNameLength = size_t(snprintf(threadId, sizeof(threadId), "%llu", (unsigned long long)m.threadId));
+      threadName = threadId;
+    } else {
+      threadNameLength = strlen(threadName);
+    }
+  }
+
+#if defined(MINILOG_RAW_OUTPUT)
+  const size_t newlineLength = 0;
+#else
+  const size_t newlineLength = 1;
+#endif
+
+  if (thread_.joinable()) {
+    // the queue is bounded: Paranoid and Debug go first, when it is half full
+    const size_t lineLength = colorLength + (config.threadNames ? threadNameLength + 3 : 0) + textLength + newlineLength +
+                              (colors_ ? sizeof(kReset) - 1 : 0);
+    const size_t queued = queueSize_.load(std::memory_order_relaxed) + stagingSize_ + lineLength;
+    if (queued > queueCapacity_ || (m.level <= minilog::Debug && queued > queueCapacity_ / 2)) {
+      numDropped_++;
+      countDropped();
+      return;
+    }
+    if (numDropped_) {
+      char notice[96];
+      append(notice,
+             size_t(snprintf(notice, sizeof(notice), "minilog: %llu console messages dropped\n", (unsigned long long)numDropped_)));
+      numDropped_ = 0;
+    }
+  }
+
+  append(color, colorLength);
+  if (config.threadNames) {
+    append("(", 1);
+    append(threadName, threadNameLength);
+    append("):", 2);
+  }
+  append(m.text, textLength);
+  append("\n", newlineLength);
+  if (colors_)
+    append(kReset, sizeof(kReset) - 1);
+
+  if (!batchDepth_)
+    flush();
+}
+
+void ConsoleWriter::append(const char* data, size_t size) {
+  while (size) {
+    if (stagingSize_ == kStagingSize)
+      flush();
+    const size_t n = size < kStagingSize - stagingSize_ ? size : kStagingSize - stagingSize_;
+    memcpy(staging_ + stagingSize_, data, n);
+    stagingSize_ += n;
+    data += n;
+    size -= n;
+  }
+}
+
+void ConsoleWriter::flush() {
+  if (!stagingSize_)
+    return;
+
+  if (thread_.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      queue_.insert(queue_.end(), staging_, staging_ + stagingSize_);
+      queueSize_.store(queue_.size(), std::memory_order_relaxed);
+    }
+    cv_.notify_one();
+  } else {
+    writeOut(staging_, stagingSize_);
+  }
+
+  stagingSize_ = 0;
+}
+
+void ConsoleWriter::writeOut(const char* data, size_t size) {
+  // whatever the application printed so far goes first
+  fflush(stdout);
+
+#if OS_WINDOWS
+  DWORD written = 0;
+  WriteFile(GetStdHandle(STD_OUTPUT_HANDLE), data, DWORD(size), &written, nullptr);
+#else
+  struct iovec iov = {const_cast<char*>(data), size};
+  writeAll(STDOUT_FILENO, &iov, 1);
+#endif // OS_WINDOWS
+}
+
+void ConsoleWriter::threadProc() {
+  std::vector<char> writing;
+  writing.reserve(queueCapacity_);
+
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [this]() { return !queue_.empty() || stopRequested_; });
+      if (queue_.empty())
+        break;
+      writing.swap(queue_);
+      queueSize_.store(0, std::memory_order_relaxed);
+    }
+    writeOut(writing.data(), writing.size());
+    writing.clear();
+  }
+}
+
+/// sinks
+
+static const char* const kLevelNames[] = {"Paranoid", "Debug", "Log", "Warning", "FatalError"};
+
+#if OS_WINDOWS
+using socklen_t = int;
+#endif // OS_WINDOWS
+
+bool Sink::open(int id, const minilog::SinkConfig& cfg) {
+  using namespace minilog;
+
+  id_ = id;
+  cfg_ = cfg;
+
+  if (cfg.format == SinkFormat_Binary && cfg.type != Sink_File)
+    return false;
+
+  switch (cfg.type) {
+  case Sink_File: {
+    if (!cfg.fileName)
+      return false;
+    fileName_ = cfg.fileName;
+    cfg_.fileName = fileName_.c_str();
+    LogConfig fileCfg = {};
+    fileCfg.binaryLog = cfg.format == SinkFormat_Binary;
+    fileCfg.fileBackend = cfg.fileBackend;
+    fileCfg.forceFlush = cfg.forceFlush;
+    fileCfg.batchFlushLevel = cfg.flushLevel;
+    if (!file_.open(fileName_.c_str(), fileCfg))
+      return false;
+    if (fileCfg.binaryLog)
+      binaryWriter_.begin(file_);
+    break;
+  }
+  case Sink_Console:
+    break;
+  case Sink_Syslog: {
+#if OS_WINDOWS
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData))
+      return false;
+#endif // OS_WINDOWS
+    syslogTag_ = cfg.syslogTag ? cfg.syslogTag : "minilog";
+    cfg_.syslogTag = syslogTag_.c_str();
+    cfg_.syslogHost = nullptr;
+    static_assert(sizeof(sockaddr_in) <= sizeof(address_));
+    sockaddr_in* addr = reinterpret_cast<sockaddr_in*>(address_);
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(cfg.syslogPort);
+    if (inet_pton(AF_INET, cfg.syslogHost ? cfg.syslogHost : "127.0.0.1", &addr->sin_addr) != 1)
+      return false;
+    socket_ = int(socket(AF_INET, SOCK_DGRAM, 0));
+    if (socket_ < 0)
+      return false;
+    break;
+  }
+  case Sink_Memory:
+    memory_.resize(cfg.memoryCapacity > 1024 ? cfg.memoryCapacity : 1024);
+    break;
+  case Sink_User:
+    if (!cfg.writeFn)
+      return false;
+    break;
+  default:
+    return false;
+  }
+
+  if (cfg.format == SinkFormat_HTML) {
+    const std::string intro = getHTMLIntro(config.htmlPageTitle, config.htmlPageHeader);
+    writeData(Log, intro.data(), intro.size());
+  }
+
+  return true;
+}
+
+void Sink::close() {
+  if (cfg_.format == minilog::SinkFormat_HTML) {
+    const char* footer = getHTMLOutro(config.htmlPageFooter);
+    writeData(minilog::Log, footer, strlen(footer));
+  }
+
+  flush();
+
+  file_.close();
+
+  if (socket_ >= 0) {
+#if OS_WINDOWS
+    closesocket(SOCKET(socket_));
+    WSACleanup();
+#else
+    ::close(socket_);
+#endif // OS_WINDOWS
+    socket_ = -1;
+  }
+}
+
+void Sink::write(const LogMessage& m, const char* data, size_t size) {
+  using namespace minilog;
+
+  if (cfg_.format == SinkFormat_Binary) {
+    binaryWriter_.write(file_, m);
+  } else if (cfg_.type == Sink_Console && cfg_.format == SinkFormat_Text) {
+    // the same colors as the default console output
+    printMessageToConsole(m, cfg_.minLevel);
+  } else {
+    writeData(m.level, data, size);
+  }
+
+  if (cfg_.type == Sink_File)
+    file_.endMessage(m.level);
+
+  if (cfg_.forceFlush || m.level >= cfg_.flushLevel)
+    flush();
+}
+
+void Sink::writeData(minilog::eLogLevel level, const char* data, size_t size) {
+  using namespace minilog;
+
+  switch (cfg_.type) {
+  case Sink_File:
+    file_.write(data, size);
+    break;
+  case Sink_Console:
+    fwrite(data, 1, size, stdout);
+    break;
+  case Sink_Syslog: {
+    // RFC 3164: <PRI>TAG: MSG, facility "user"
+    static const int kSeverity[] = {7, 7, 6, 4, 2};
+    char packet[1024];
+    int length = snprintf(packet, sizeof(packet), "<%d>%s: ", 8 + kSeverity[level], syslogTag_.c_str());
+    if (length < 0 || length >= int(sizeof(packet)))
+      break;
+    const size_t n = size < sizeof(packet) - size_t(length) ? size : sizeof(packet) - size_t(length);
+    memcpy(packet + length, data, n);
+    length += int(n);
+    while (length && packet[length - 1] == '\n')
+      length--;
+    sendto(socket_, packet, length, 0, reinterpret_cast<const sockaddr*>(address_), socklen_t(sizeof(sockaddr_in)));
+    break;
+  }
+  case Sink_Memory:
+    // overwrite the oldest data
+    while (size) {
+      const size_t n = size < memory_.size() - memoryPos_ ? size : memory_.size() - memoryPos_;
+      memcpy(memory_.data() + memoryPos_, data, n);
+      data += n;
+      size -= n;
+      memoryPos_ += n;
+      if (memoryPos_ == memory_.size()) {
+        memoryPos_ = 0;
+        memoryWrapped_ = true;
+      }
+    }
+    break;
+  case Sink_User:
+    cfg_.writeFn(cfg_.userData, level, data, size);
+    break;
+  }
+}
+
+void Sink::flush() {
+  switch (cfg_.type) {
+  case minilog::Sink_File:
+    file_.flush();
+    break;
+  case minilog::Sink_Console:
+    fflush(stdout);
+    break;
+  case minilog::Sink_User:
+    if (cfg_.flushFn)
+      cfg_.flushFn(cfg_.userData);
+    break;
+  default:
+    break;
+  }
+}
+
+size_t Sink::readMemory(char* buffer, size_t bufferSize) const {
+  if (!bufferSize)
+    return 0;
+
+  const size_t stored = memoryWrapped_ ? memory_.size() : memoryPos_;
+  size_t size = stored < bufferSize - 1 ? stored : bufferSize - 1;
+
+  // the newest `size` bytes end at memoryPos_
+  const size_t start = (memoryPos_ + memory_.size() - size) % memory_.size();
+  const size_t first = size < memory_.size() - start ? size : memory_.size() - start;
+
+  memcpy(buffer, memory_.data() + start, first);
+  memcpy(buffer + first, memory_.data(), size - first);
+
+  // do not start in the middle of a message
+  if (size < stored || start != 0 || memoryWrapped_) {
+    const char* nl = static_cast<const char*>(memchr(buffer, '\n', size));
+    const size_t skip = nl ? size_t(nl - buffer) + 1 : size;
+    memmove(buffer, buffer + skip, size - skip);
+    size -= skip;
+  }
+
+  buffer[size] = 0;
+
+  return size;
+}
+
+// one line of JSON Lines output built from the message data (see MessageDetails), never allocates; the string values are
+// cut if the buffer is too small
+// {"level":"Log","time":"12:00:00.000","thread":"MainThread","tid":1234,"category":"net","callstack":["Proc","Proc2"],"message":"...","fields":{...}}
+static char* writeJSONLine(char* buffer, const char* bufferEnd, const LogMessage& m, minilog::eTimeStampPrecision precision) {
+  // reserve space for "}}\n"
+  const char* end = bufferEnd - 3;
+  char* out = buffer;
+
+  out = copyString(out, end, "{\"level\":\"");
+  out = copyString(out, end, kLevelNames[m.level]);
+  out = copyString(out, end, "\"");
+
+  // LogConfig::writeTimeStamp customizes only the text, JSON always gets the built-in format
+  if (!m.raw) {
+    char timeStamp[32];
+    const char* timeStampEnd = writeTimeStampAt(timeStamp, timeStamp + sizeof(timeStamp), m.timeStamp, precision);
+    out = copyString(out, end, ",\"time\":");
+    out = writeJSONString(out, end, timeStamp, size_t(timeStampEnd - timeStamp) - 3); // without the 3 spaces
+  }
+
+  out = copyString(out, end, ",\"thread\":");
+  if (m.threadName) {
+    out = writeJSONString(out, end, m.threadName, strlen(m.threadName));
+  } else {
+    out = writeInteger(out, end, m.threadId, false);
+  }
+  out = copyString(out, end, ",\"tid\":");
+  out = writeInteger(out, end, m.threadId, false);
+
+  // without the details (an output was added after the message had been logged) there is only the text
+  if (!m.details) {
+    out = copyString(out, end, ",\"message\":");
+    out = writeJSONString(out, end, m.msg, strlen(m.msg));
+    *out++ = '}';
+    *out++ = '\n';
+    return out;
+  }
+
+  const MessageDetails d = getMessageDetails(m.details);
+  const char* callstack = m.details + sizeof(MessageDetails);
+  const char* callstackEnd = callstack + d.callstackSize;
+  const char* category = callstack + 1;
+  const size_t categoryLength = strlen(category);
+
+  if (categoryLength) {
+    out = copyString(out, end, ",\"category\":");
+    out = writeJSONString(out, end, category, categoryLength);
+  }
+
+  // LogConfig::callstackMaxDepth "..." stays "..."
+  out = copyString(out, end, ",\"callstack\":[");
+  bool isFirst = !*callstack;
+  if (!isFirst)
+    out = copyString(out, end, "\"...\"");
+  for (const char* proc = category + categoryLength + 1; proc < callstackEnd; proc += strlen(proc) + 1) {
+    if (!isFirst)
+      out = copyString(out, end, ",");
+    isFirst = false;
+    out = writeJSONString(out, end, proc, getProcNameLength(proc, strlen(proc)));
+  }
+  out = copyString(out, end, "]");
+
+  out = copyString(out, end, ",\"message\":");
+  out = writeJSONString(out, end, m.msg, d.numFields ? d.msgLength : strlen(m.msg));
+
+  if (d.numFields) {
+    out = copyString(out, end, ",\"fields\":{");
+    const char* data = callstackEnd;
+    const char* dataEnd = m.details + d.size;
+    minilog::Field f("", false);
+    for (uint32_t i = 0; i != d.numFields && (data = readField(data, dataEnd, f)); i++) {
+      if (i)
+        out = copyString(out, end, ",");
+      out = writeJSONString(out, end, f.key, strlen(f.key));
+      out = copyString(out, end, ":");
+      out = writeFieldValue(out, end, f);
+    }
+    *out++ = '}';
+  }
+
+  *out++ = '}';
+  *out++ = '\n';
+
+  return out;
+}
+
+// every message is formatted only once per distinct format of all sinks
+static void writeMessageToSinks(const LogMessage& m) {
+  static std::vector<char> formatted[minilog::SinkFormat_Binary]; // guarded by logMutex
+
+  bool isFormatted[minilog::SinkFormat_Binary] = {};
+
+  for (Sink* sink : sinks) {
+    const minilog::SinkConfig& cfg = sink->getConfig();
+
+    if (m.level < cfg.minLevel)
+      continue;
+
+    if (cfg.format == minilog::SinkFormat_Binary) {
+      sink->write(m, nullptr, 0);
+      continue;
+    }
+
+    std::vector<char>& out = formatted[cfg.format];
+
+    if (!isFormatted[cfg.format]) {
+      isFormatted[cfg.format] = true;
+      out.clear();
+      if (cfg.format == minilog::SinkFormat_JSON) {
+        out.resize(getJSONLineLength(m));
+        out.resize(size_t(writeJSONLine(out.data(), out.data() + out.size(), m, config.timeStampPrecision) - out.data()));
+      } else {
+        char threadId[24];
+        FilePart parts[kMaxLineParts];
+        const bool html = cfg.format == minilog::SinkFormat_HTML;
+        const uint32_t numParts = getLineParts(m, html, config.threadNames, mainThreadName, parts, threadId);
+        for (uint32_t i = 0; i != numParts; i++) {
+          const char* data = static_cast<const char*>(parts[i].data);
+          out.insert(out.end(), data, data + parts[i].size);
+        }
+      }
+    }
+
+    sink->write(m, out.data(), out.size());
+  }
+}
+
+/// categories
+
+static char* trimWhitespace(char* str) {
+  while (isspace((unsigned char)*str))
+    str++;
+
+  char* end = str + strlen(str);
+
+  while (end > str && isspace((unsigned char)end[-1]))
+    *--end = 0;
+
+  return str;
+}
+
+// "Debug", "debug" or "1"
+static bool parseLogLevel(const char* str, minilog::eLogLevel* level) {
+  if (str[0] >= '0' && str[0] <= '0' + minilog::FatalError && !str[1]) {
+    *level = minilog::eLogLevel(str[0] - '0');
+    return true;
+  }
+
+  for (int i = minilog::Paranoid; i <= minilog::FatalError; i++) {
+    const char* name = kLevelNames[i];
+    size_t j = 0;
+    while (name[j] && tolower((unsigned char)str[j]) == tolower((unsigned char)name[j]))
+      j++;
+    if (!name[j] && !str[j]) {
+      *level = minilog::eLogLevel(i);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static void updateInheritedCategoryLevels() {
+  std::lock_guard<std::mutex> lock(categoryMutex);
+
+  for (const auto& c : categories) {
+    if (c.second->inherited.load(std::memory_order_relaxed))
+      c.second->level.store(config.logLevel, std::memory_order_relaxed);
+  }
+}
+
+// polls LogConfig::categoryControlFile, logMutex must be locked
+static void reloadCategoryLevelsIfDue() {
+  const bool requested = categoryReloadRequested.load(std::memory_order_relaxed) &&
+                         categoryReloadRequested.exchange(false, std::memory_order_relaxed);
+  const uint64_t nowMs = getCurrentTimeNs() / 1000000ull;
+
+  if (!requested && nowMs - categoryLastCheckMs < config.categoryControlFileIntervalMs)
+    return;
+
+  categoryLastCheckMs = nowMs;
+
+  struct stat st;
+
+  if (stat(config.categoryControlFile, &st) != 0)
+    return;
+
+  if (!requested && st.st_mtime == categoryFileModifiedTime && int64_t(st.st_size) == categoryFileSize)
+    return;
+
+  categoryFileModifiedTime = st.st_mtime;
+  categoryFileSize = int64_t(st.st_size);
+
+  minilog::categoryLoadLevels(config.categoryControlFile);
+}
+
+void minilog::log(eLogLevel level, const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  log(level, format, args);
+  va_end(args);
+}
+
+static void dispatchMessage(const LogMessage& m) {
+  if (config.categoryControlFile)
+    reloadCategoryLevelsIfDue();
+
+  // sinks may want more than LogConfig::logLevel
+  if (m.raw || m.categorized || m.backtrace || m.level >= config.logLevel) {
+    writeMessageToLog(m);
+
+    if (m.printToConsole)
+      printMessageToConsole(m, config.logLevelPrintToConsole);
+
+    if (callbackDispatcher.isRunning())
+      callbackDispatcher.post(m.level, m.msg);
+    else
+      callbackRegistry.invoke(m.level, m.msg);
+  }
+
+  if (!sinks.empty())
+    writeMessageToSinks(m);
+}
+
+// logf() passes its text as the only argument of this format, formatText() copies it instead of running vsnprintf() again;
+// compared by address, deferred formatting and the binary log see an ordinary "%s"
+static const char kTextFormat[] = "%s";
+
+// vsnprintf() which only copies the text of a kTextFormat message, `args` is not consumed
+static int formatText(char* buffer, size_t size, const char* format, va_list args) {
+  va_list argsCopy;
+  va_copy(argsCopy, args);
+
+  if (format != kTextFormat) {
+    const int length = vsnprintf(buffer, size, format, argsCopy);
+    va_end(argsCopy);
+    return length;
+  }
+
+  const char* text = va_arg(argsCopy, const char*);
+  va_end(argsCopy);
+
+  const size_t length = strlen(text);
+
+  if (size) {
+    const size_t n = length < size ? length : size - 1;
+    memcpy(buffer, text, n);
+    buffer[n] = 0;
+  }
+
+  return int(length);
+}
+
+// writes a time stamp, the callstack and the message into `buffer`; returns where the actual message starts, the callstack
+// starts at `callstackOffset`
+static char* formatMessage(char* buffer,
+                           const char* bufferEnd,
+                           uint64_t timeStamp,
+                           const minilog::Category* category,
+                           uint16_t& callstackOffset,
+                           const char* format,
+                           va_list args) {
+  char* scratchBuf = config.writeTimeStamp ? config.writeTimeStamp(buffer, bufferEnd)
+                                           : writeTimeStampAt(buffer, bufferEnd, timeStamp, config.timeStampPrecision);
+  callstackOffset = uint16_t(scratchBuf - buffer);
+  scratchBuf = writeCurrentProcsNesting(scratchBuf, bufferEnd, category);
+
+  formatText(scratchBuf, size_t(bufferEnd - scratchBuf), format, args);
+
+  return scratchBuf;
+}
+
+// appends "\tkey=value key=value" to the 0-terminated `msg`, the values are written as in JSON; returns the end of `msg`
+static char* writeFields(char* msg, const char* end, const minilog::Field* fields, size_t numFields) {
+  char* out = msg + strlen(msg);
+
+  if (!numFields || out >= end)
+    return out;
+
+  *out++ = '\t';
+
+  for (size_t i = 0; i != numFields; i++) {
+    if (i && out < end)
+      *out++ = ' ';
+    out = copyString(out, end, fields[i].key);
+    if (out < end)
+      *out++ = '=';
+    out = writeFieldValue(out, end, fields[i]);
+  }
+
+  *out = 0;
+
+  return out;
+}
+
+// deferred formatting: `m.text` holds a 0-terminated time stamp + callstack prefix followed by the arguments captured for
+// `format`; fills `captured` and formats the message into `buffer` if anything needs the text
+static void unpackDeferredMessage(LogMessage& m,
+                                  CapturedMessage& captured,
+                                  uint8_t flags,
+                                  uint16_t callstackOffset,
+                                  uint32_t msgOffset,
+                                  const char* format,
+                                  uint64_t timeStamp,
+                                  char* buffer,
+                                  const char* bufferEnd) {
+  const char* prefix = m.text;
+  const size_t prefixLength = strlen(prefix);
+  captured.timeStamp = timeStamp;
+  captured.raw = (flags & MessageRing::Flag_Raw) != 0;
+  captured.callstack = prefix + callstackOffset;
+  captured.callstackLength = uint32_t(prefixLength - callstackOffset);
+  captured.format = format;
+  captured.args = reinterpret_cast<const uint8_t*>(prefix + prefixLength + 1);
+  captured.argsSize = uint32_t(msgOffset - prefixLength - 1);
+  m.captured = &captured;
+  m.text = buffer;
+  m.msg = buffer;
+  *buffer = 0;
+  if (isTextNeeded(m.level, m.printToConsole)) {
+    char* out = buffer;
+    if (!captured.raw && !(flags & MessageRing::Flag_CustomTimeStamp))
+      out = writeTimeStampAt(buffer, bufferEnd, timeStamp, config.timeStampPrecision);
+    if (prefixLength < size_t(bufferEnd - out)) {
+      memcpy(out, prefix, prefixLength);
+      out += prefixLength;
+    }
+    m.msg = out;
+    formatCapturedArgs(out, bufferEnd, captured.format, captured.args, captured.args + captured.argsSize);
+  }
+}
+
+// a message buffer which starts on the stack and moves to an OverflowArena of the calling thread when the message does not
+// fit; a message logged while the arena is in use (e.g. from a sink) gets a heap buffer of its own
+class MessageBuffer {
+ public:
+  MessageBuffer(OverflowArena& arena, char* inlineData, size_t inlineSize)
+      : arena_(arena), data_(inlineData), size_(inlineSize) {}
+  ~MessageBuffer() {
+    if (acquired_)
+      releaseOverflowArena(arena_);
+  }
+  MessageBuffer(const MessageBuffer&) = delete;
+  MessageBuffer& operator=(const MessageBuffer&) = delete;
+
+  char* data() const {
+    return data_;
+  }
+  size_t size() const {
+    return size_;
+  }
+  // at least `size` bytes, the first `keep` bytes are preserved
+  char* grow(size_t size, size_t keep);
+
+ private:
+  OverflowArena& arena_;
+  bool acquired_ = false;
+  OverflowArena heap_; // the arena was in use
+  char* data_;
+  size_t size_;
+};
+
+char* MessageBuffer::grow(size_t size, size_t keep) {
+  if (size <= size_)
+    return data_;
+
+  if (!acquired_ && !heap_.data && !arena_.inUse) {
+    arena_.inUse = true;
+    acquired_ = true;
+  }
+
+  OverflowArena& storage = acquired_ ? arena_ : heap_;
+
+  data_ = growOverflowArena(storage, data_, keep, size);
+  size_ = storage.size;
+
+  return data_;
+}
+
+// the most formatMessage() writes before the message, custom time stamps are assumed to fit into 64 chars
+static size_t getMessagePrefixLength(const minilog::Category* category, const ThreadLogContext* ctx) {
+  return 64 + (category ? strlen(category->name) + 3 : 0) + 3 + ctx->procsPrefixLength[ctx->procsNestingLevel];
+}
+
+// formats the message followed by the fields at `offset` of `text`; the buffer grows instead of truncating the message;
+// returns the length of the message without the fields
+static size_t writeMessageText(MessageBuffer& text, size_t offset, FieldList fields, const char* format, va_list args) {
+  const int length = formatText(text.data() + offset, text.size() - offset, format, args);
+
+  if (length < 0) {
+    text.data()[offset] = 0;
+    return 0;
+  }
+
+  const size_t msgEnd = offset + size_t(length);
+
+  if (msgEnd >= text.size()) {
+    text.grow(msgEnd + 1 + (fields.size() ? 256 : 0), offset);
+    formatText(text.data() + offset, text.size() - offset, format, args);
+  }
+
+  // the fields are written again into a larger buffer until they fit
+  while (fields.size()) {
+    const char* end = text.data() + text.size() - 1;
+    if (writeFields(text.data() + offset, end, fields.begin(), fields.size()) < end)
+      break;
+    text.data()[msgEnd] = 0;
+    text.grow(text.size() * 2, msgEnd + 1);
+  }
+
+  return size_t(length);
+}
+
+// writes MessageDetails after the first `textSize` bytes of `text` (the text with its 0), returns the size of both
+static size_t appendMessageDetails(MessageBuffer& text,
+                                   size_t textSize,
+                                   size_t msgLength,
+                                   const minilog::Category* category,
+                                   const ThreadLogContext* ctx,
+                                   FieldList fields) {
+  text.grow(textSize + getMessageDetailsSize(category, ctx, fields), textSize);
+
+  return size_t(writeMessageDetails(text.data() + textSize, msgLength, category, ctx, fields) - text.data());
+}
+
+// writes a message into a MessageRing slot or a ThreadBuffer record (both have the same fields) and its `text`;
+// returns the size of the text including captured arguments or the terminating 0
+template <typename T>
+static uint32_t writeQueuedMessage(T* q,
+                                   char* text,
+                                   const char* textEnd,
+                                   bool printToConsole,
+                                   bool raw,
+                                   const minilog::Category* category,
+                                   FieldList fields,
+                                   ThreadLogContext* ctx,
+                                   const char* format,
+                                   va_list args) {
+  q->printToConsole = printToConsole;
+  q->threadName = ctx->threadName;
+  q->threadId = ctx->threadId;
+  q->threadIndex = ctx->threadIndex;
+  q->flags = (raw ? MessageRing::Flag_Raw : 0) | (category ? MessageRing::Flag_Categorized : 0) |
+             (fields.size() ? MessageRing::Flag_Structured : 0);
+  q->format = nullptr;
+  q->timeStamp = getTimeStamp();
+
+  // a deep callstack leaves no room for the arguments, such messages are formatted and spilled below
+  if ((config.deferredFormatting || config.binaryLog) && !fields.size() && getMessagePrefixLength(category, ctx) < size_t(textEnd - text) / 2) {
+    // only the callstack (and a custom time stamp) is written as text, the arguments are captured as raw bytes
+    char* prefixEnd = text;
+    if (!raw && config.writeTimeStamp) {
+      prefixEnd = config.writeTimeStamp(prefixEnd, textEnd);
+      q->flags |= MessageRing::Flag_CustomTimeStamp;
+    }
+    q->callstackOffset = uint16_t(prefixEnd - text);
+    if (!raw)
+      prefixEnd = writeCurrentProcsNesting(prefixEnd, textEnd, category);
+    *prefixEnd++ = 0;
+
+    va_list argsCopy;
+    va_copy(argsCopy, args);
+    const int argsSize = captureFormatArgs(reinterpret_cast<uint8_t*>(prefixEnd), reinterpret_cast<const uint8_t*>(textEnd), format, argsCopy);
+    va_end(argsCopy);
+
+    char* details = prefixEnd + (argsSize >= 0 ? argsSize : 0);
+    const bool isDetails = isDetailsNeeded();
+
+    if (argsSize >= 0 && (!isDetails || getMessageDetailsSize(category, ctx, {}) <= size_t(textEnd - details))) {
+      q->format = format;
+      q->msgOffset = uint32_t(details - text);
+      if (!isDetails)
+        return q->msgOffset;
+      q->flags |= MessageRing::Flag_Details;
+      return uint32_t(writeMessageDetails(details, 0, category, ctx, {}) - text);
+    }
+
+    // cannot capture these arguments (or there is no room left for the details), format them right away
+  }
+
+  // starts in `text`, a message which does not fit continues in the overflow buffer and is spilled to the heap
+  MessageBuffer buffer(ctx->overflow[0], text, size_t(textEnd - text) + 1);
+  size_t msgOffset = 0;
+
+  q->callstackOffset = 0;
+
+  if (!raw) {
+    buffer.grow(getMessagePrefixLength(category, ctx) + 64, 0);
+    const char* bufferEnd = buffer.data() + buffer.size() - 1;
+    char* out = config.writeTimeStamp ? config.writeTimeStamp(buffer.data(), bufferEnd)
+                                      : writeTimeStampAt(buffer.data(), bufferEnd, q->timeStamp, config.timeStampPrecision);
+    q->callstackOffset = uint16_t(out - buffer.data());
+    msgOffset = size_t(writeCurrentProcsNesting(out, bufferEnd, category) - buffer.data());
+  }
+
+  const size_t msgLength = writeMessageText(buffer, msgOffset, fields, format, args);
+
+  q->msgOffset = uint32_t(msgOffset);
+
+  size_t textSize = msgOffset + strlen(buffer.data() + msgOffset) + 1;
+
+  if (isDetailsNeeded()) {
+    textSize = appendMessageDetails(buffer, textSize, msgLength, category, ctx, fields);
+    q->flags |= MessageRing::Flag_Details;
+  }
+
+  if (buffer.data() == text)
+    return uint32_t(textSize);
+
+  char* spilled = new char[textSize];
+  memcpy(spilled, buffer.data(), textSize);
+  memcpy(text, &spilled, sizeof(spilled));
+  q->flags |= MessageRing::Flag_Spilled;
+
+  return sizeof(spilled);
+}
+
+// the reverse of writeQueuedMessage(), logMutex must be locked; deferred messages which do not fit into the stack buffer
+// are formatted in `overflow`, see MessageBuffer
+template <typename T>
+static void dispatchQueuedMessage(const T* q, minilog::eLogLevel level, const char* text, OverflowArena& overflow) {
+  const char* queuedText = text;
+  if (q->flags & MessageRing::Flag_Spilled)
+    memcpy(&text, queuedText, sizeof(text));
+  LogMessage m;
+  m.level = level;
+  m.printToConsole = q->printToConsole;
+  m.threadName = q->threadName;
+  m.threadId = q->threadId;
+  m.threadIndex = q->threadIndex;
+  m.timeStamp = q->timeStamp;
+  m.text = text;
+  m.msg = text + q->msgOffset;
+  if (!q->format && !(q->flags & MessageRing::Flag_Raw))
+    m.callstack = text + q->callstackOffset;
+  if (q->flags & MessageRing::Flag_Details)
+    m.details = q->format ? m.msg : m.msg + strlen(m.msg) + 1;
+  m.raw = (q->flags & MessageRing::Flag_Raw) != 0;
+  m.categorized = (q->flags & MessageRing::Flag_Categorized) != 0;
+  m.backtrace = (q->flags & MessageRing::Flag_Backtrace) != 0;
+  m.structured = (q->flags & MessageRing::Flag_Structured) != 0;
+  CapturedMessage captured;
+  char inlineText[8192];
+  MessageBuffer buffer(overflow, inlineText, sizeof(inlineText));
+  while (q->format) {
+    const char* bufferEnd = buffer.data() + buffer.size() - 1;
+    unpackDeferredMessage(m, captured, q->flags, q->callstackOffset, q->msgOffset, q->format, q->timeStamp, buffer.data(), bufferEnd);
+    // formatted again into a larger buffer until it fits
+    if (m.msg + strlen(m.msg) < bufferEnd)
+      break;
+    buffer.grow(2 * buffer.size(), 0);
+    m.text = text;
+    m.msg = text + q->msgOffset;
+  }
+  dispatchMessage(m);
+  MessageRing::deleteSpilledText(q, queuedText);
+}
+
+// async mode: format directly into a ring slot, nothing is copied afterwards
+static void submitMessageAsync(minilog::eLogLevel level,
+                               bool printToConsole,
+                               bool raw,
+                               const minilog::Category* category,
+                               FieldList fields,
+                               ThreadLogContext* ctx,
+                               const char* format,
+                               va_list args) {
+  MessageRing::Slot* slot = asyncQueue.claim(level);
+
+  if (!slot)
+    return; // dropped according to LogConfig::asyncQueueFullPolicy
+
+  char* text = MessageRing::slotText(slot);
+
+  writeQueuedMessage(slot, text, text + MessageRing::kTextSize - 1, printToConsole, raw, category, fields, ctx, format, args);
+
+  asyncQueue.publish(slot);
+}
+
+// LogConfig::threadBuffers: append to the buffer of the calling thread without locking
+static void submitMessageThreadBuffer(minilog::eLogLevel level,
+                                      bool printToConsole,
+                                      bool raw,
+                                      const minilog::Category* category,
+                                      FieldList fields,
+                                      ThreadLogContext* ctx,
+                                      const char* format,
+                                      va_list args) {
+  ThreadBuffer* buffer = threadBufferCollector.getBuffer(ctx);
+  ThreadBuffer::Record* r = threadBufferCollector.beginWrite(buffer, level);
+
+  if (!r)
+    return;
+
+  char* text = ThreadBuffer::recordText(r);
+
+  r->level = level;
+
+  const uint32_t textSize =
+      writeQueuedMessage(r, text, text + ThreadBuffer::kMaxTextSize - 1, printToConsole, raw, category, fields, ctx, format, args);
+
+  buffer->endWrite(r, textSize);
+
+  if (buffer->isHalfFull())
+    threadBufferCollector.wakeIfSleeping();
+}
+
+static void submitMessageSync(minilog::eLogLevel level,
+                              bool printToConsole,
+                              bool raw,
+                              const minilog::Category* category,
+                              FieldList fields,
+                              ThreadLogContext* ctx,
+                              const char* format,
+                              va_list args) {
+  // most messages fit here, longer ones continue in ThreadLogContext::overflow
+  constexpr uint32_t kInlineLength = 512;
+
+  char inlineText[kInlineLength];
+  MessageBuffer text(ctx->overflow[0], inlineText, kInlineLength);
+
+  // a deep callstack does not fit into the inline buffer
+  if (!raw)
+    text.grow(getMessagePrefixLength(category, ctx) + 64, 0);
+
+  char* buffer = text.data();
+  const char* bufferEnd = buffer + text.size() - 1;
+
+  LogMessage m;
+  m.level = level;
+  m.printToConsole = printToConsole;
+  m.threadName = ctx->threadName;
+  m.threadId = ctx->threadId;
+  m.threadIndex = ctx->threadIndex;
+  m.raw = raw;
+  m.categorized = category != nullptr;
+  m.structured = fields.size() != 0;
+
+  // structured messages are formatted right away, the binary log gets them as "%s"
+  if (config.binaryLog && !fields.size()) {
+    // larger arguments (long strings) go to the binary log as formatted text
+    constexpr uint32_t kMaxArgsLength = 32 * 1024;
+
+    uint8_t inlineArgs[kInlineLength];
+    MessageBuffer argsBuffer(ctx->overflow[1], reinterpret_cast<char*>(inlineArgs), kInlineLength);
+    CapturedMessage captured;
+
+    va_list argsCopy;
+    va_copy(argsCopy, args);
+    int argsSize = captureFormatArgs(inlineArgs, inlineArgs + kInlineLength, format, argsCopy);
+    va_end(argsCopy);
+
+    // -1 is also returned for unsupported conversions, those are rare enough to try again
+    if (argsSize < 0) {
+      uint8_t* args8 = reinterpret_cast<uint8_t*>(argsBuffer.grow(kMaxArgsLength, 0));
+      va_copy(argsCopy, args);
+      argsSize = captureFormatArgs(args8, args8 + kMaxArgsLength, format, argsCopy);
+      va_end(argsCopy);
+    }
+
+    if (argsSize >= 0) {
+      captured.timeStamp = getTimeStamp();
+      captured.raw = raw;
+      captured.format = format;
+      captured.args = reinterpret_cast<const uint8_t*>(argsBuffer.data());
+      captured.argsSize = uint32_t(argsSize);
+
+      char* out = buffer;
+      if (!raw)
+        out = config.writeTimeStamp ? config.writeTimeStamp(buffer, bufferEnd)
+                                    : writeTimeStampAt(buffer, bufferEnd, captured.timeStamp, config.timeStampPrecision);
+      const size_t callstackOffset = size_t(out - buffer);
+      if (!raw)
+        out = writeCurrentProcsNesting(out, bufferEnd, category);
+      const size_t msgOffset = size_t(out - buffer);
+
+      if (isTextNeeded(level, printToConsole))
+        writeMessageText(text, msgOffset, {}, format, args);
+      else
+        *out = 0;
+
+      // the binary log always needs the details
+      const size_t textSize = msgOffset + strlen(text.data() + msgOffset) + 1;
+      appendMessageDetails(text, textSize, 0, category, ctx, {});
+
+      m.timeStamp = captured.timeStamp;
+      m.text = text.data();
+      m.msg = text.data() + msgOffset;
+      m.details = text.data() + textSize;
+      captured.callstack = text.data() + callstackOffset;
+      captured.callstackLength = uint32_t(msgOffset - callstackOffset);
+      m.captured = &captured;
+
+      const std::unique_lock<std::mutex> lock = lockLogMutex();
+
+      dispatchMessage(m);
+      return;
+    }
+  }
+
+  size_t callstackOffset = 0;
+  size_t msgOffset = 0;
+
+  if (!raw) {
+    m.timeStamp = getTimeStamp();
+    char* out = config.writeTimeStamp ? config.writeTimeStamp(buffer, bufferEnd)
+                                      : writeTimeStampAt(buffer, bufferEnd, m.timeStamp, config.timeStampPrecision);
+    callstackOffset = size_t(out - buffer);
+    msgOffset = size_t(writeCurrentProcsNesting(out, bufferEnd, category) - buffer);
+  }
+
+  const size_t msgLength = writeMessageText(text, msgOffset, fields, format, args);
+
+  if (isDetailsNeeded()) {
+    const size_t textSize = msgOffset + strlen(text.data() + msgOffset) + 1;
+    appendMessageDetails(text, textSize, msgLength, category, ctx, fields);
+    m.details = text.data() + textSize;
+  }
+
+  m.text = text.data();
+  m.msg = text.data() + msgOffset;
+  if (!raw)
+    m.callstack = text.data() + callstackOffset;
+
+  const std::unique_lock<std::mutex> lock = lockLogMutex();
+
+  dispatchMessage(m);
+}
+
+// the size of the text of a backtrace entry (or its captured arguments), MessageDetails follow it
+static uint32_t getBacktraceTextSize(const BacktraceEntry& e) {
+  return e.format ? e.msgOffset : uint32_t(strlen(e.text)) + 1;
+}
+
+// the details are kept only if they fit into the entry
+static void storeBacktraceDetails(BacktraceEntry& e, size_t msgLength, const ThreadLogContext* ctx, FieldList fields) {
+  char* details = e.text + getBacktraceTextSize(e);
+
+  if (isDetailsNeeded() && getMessageDetailsSize(nullptr, ctx, fields) <= size_t(e.text + sizeof(e.text) - details)) {
+    writeMessageDetails(details, msgLength, nullptr, ctx, fields);
+    e.flags |= MessageRing::Flag_Details;
+  }
+}
+
+// keeps a message nothing wants right now in the backtrace ring of the calling thread, the arguments are captured unformatted
+static void storeBacktraceMessage(minilog::eLogLevel level, ThreadLogContext* ctx, FieldList fields, const char* format, va_list args) {
+  if (ctx->backtraceCapacity != config.backtraceSize) {
+    ctx->backtrace.reset(new BacktraceEntry[config.backtraceSize]);
+    ctx->backtraceCapacity = config.backtraceSize;
+    ctx->backtraceCount = 0;
+  }
+
+  BacktraceEntry& e = ctx->backtrace[ctx->backtraceCount++ % ctx->backtraceCapacity];
+
+  char* text = e.text;
+  const char* textEnd = text + sizeof(e.text) - 1;
+
+  e.level = level;
+  e.flags = fields.size() ? MessageRing::Flag_Structured : 0;
+  e.timeStamp = getTimeStamp();
+
+  char* prefixEnd = text;
+  if (config.writeTimeStamp) {
+    prefixEnd = config.writeTimeStamp(prefixEnd, textEnd);
+    e.flags |= MessageRing::Flag_CustomTimeStamp;
+  }
+  e.callstackOffset = uint16_t(prefixEnd - text);
+  prefixEnd = writeCurrentProcsNesting(prefixEnd, textEnd, nullptr);
+  *prefixEnd++ = 0;
+
+  if (!fields.size()) {
+    va_list argsCopy;
+    va_copy(argsCopy, args);
+    const int argsSize =
+        captureFormatArgs(reinterpret_cast<uint8_t*>(prefixEnd), reinterpret_cast<const uint8_t*>(textEnd), format, argsCopy);
+    va_end(argsCopy);
+
+    if (argsSize >= 0) {
+      e.format = format;
+      e.msgOffset = uint32_t(prefixEnd - text) + uint32_t(argsSize);
+      storeBacktraceDetails(e, 0, ctx, {});
+      return;
+    }
+  }
+
+  // cannot capture these arguments (or the fields), format them right away
+  e.format = nullptr;
+  char* msg = formatMessage(text, textEnd, e.timeStamp, nullptr, e.callstackOffset, format, args);
+  const size_t msgLength = strlen(msg);
+  writeFields(msg, textEnd, fields.begin(), fields.size());
+  e.msgOffset = uint32_t(msg - text);
+  storeBacktraceDetails(e, msgLength, ctx, fields);
+}
+
+// copies a backtrace entry into a MessageRing slot or a ThreadBuffer record, returns the size of the text
+template <typename T>
+static uint32_t writeBacktraceEntry(T* q, char* text, const BacktraceEntry& e, const ThreadLogContext* ctx) {
+  uint32_t textSize = getBacktraceTextSize(e);
+  if (e.flags & MessageRing::Flag_Details)
+    textSize += getMessageDetails(e.text + textSize).size;
+  q->printToConsole = true;
+  q->threadName = ctx->threadName;
+  q->threadId = ctx->threadId;
+  q->threadIndex = ctx->threadIndex;
+  q->flags = e.flags | MessageRing::Flag_Backtrace;
+  q->format = e.format;
+  q->timeStamp = e.timeStamp;
+  q->callstackOffset = e.callstackOffset;
+  q->msgOffset = e.msgOffset;
+  memcpy(text, e.text, textSize);
+  return textSize;
+}
+
+static void submitBacktraceMessage(const BacktraceEntry& e, ThreadLogContext* ctx) {
+  if (config.stats)
+    getStatsShard().numMessages[e.level].fetch_add(1, std::memory_order_relaxed);
+
+  if (asyncQueue.isRunning()) {
+    MessageRing::Slot* slot = asyncQueue.claim(e.level);
+
+    if (!slot)
+      return; // dropped according to LogConfig::asyncQueueFullPolicy
+
+    writeBacktraceEntry(slot, MessageRing::slotText(slot), e, ctx);
+    asyncQueue.publish(slot);
+    return;
+  }
+
+  if (threadBufferCollector.isRunning()) {
+    ThreadBuffer* buffer = threadBufferCollector.getBuffer(ctx);
+    ThreadBuffer::Record* r = threadBufferCollector.beginWrite(buffer, e.level);
+
+    if (!r)
+      return;
+
+    r->level = e.level;
+    buffer->endWrite(r, writeBacktraceEntry(r, ThreadBuffer::recordText(r), e, ctx));
+    return;
+  }
+
+  // field widths can make the formatted text much longer than the entry, see MessageBuffer
+  char inlineText[2 * MessageRing::kTextSize];
+  MessageBuffer text(ctx->overflow[0], inlineText, sizeof(inlineText));
+
+  LogMessage m;
+  m.level = e.level;
+  m.threadName = ctx->threadName;
+  m.threadId = ctx->threadId;
+  m.threadIndex = ctx->threadIndex;
+  m.timeStamp = e.timeStamp;
+  if (e.flags & MessageRing::Flag_Details)
+    m.details = e.text + getBacktraceTextSize(e);
+  m.backtrace = true;
+  m.structured = (e.flags & MessageRing::Flag_Structured) != 0;
+
+  CapturedMessage captured;
+
+  for (;;) {
+    m.text = e.text;
+    m.msg = e.text + e.msgOffset;
+    if (!e.format) {
+      m.callstack = e.text + e.callstackOffset;
+      break;
+    }
+    const char* textEnd = text.data() + text.size() - 1;
+    unpackDeferredMessage(m, captured, e.flags, e.callstackOffset, e.msgOffset, e.format, e.timeStamp, text.data(), textEnd);
+    // formatted again into a larger buffer until it fits
+    if (m.msg + strlen(m.msg) < textEnd)
+      break;
+    text.grow(2 * text.size(), 0);
+  }
+
+  const std::unique_lock<std::mutex> lock = lockLogMutex();
+
+  dispatchMessage(m);
+}
+
+static void submitMessageV(minilog::eLogLevel level,
+                           bool printToConsole,
+                           bool raw,
+                           const minilog::Category* category,
+                           FieldList fields,
+                           ThreadLogContext* ctx,
+                           const char* format,
+                           va_list args) {
+  if (config.stats)
+    getStatsShard().numMessages[level].fetch_add(1, std::memory_order_relaxed);
+
+  if (asyncQueue.isRunning())
+    submitMessageAsync(level, printToConsole, raw, category, fields, ctx, format, args);
+  else if (threadBufferCollector.isRunning())
+    submitMessageThreadBuffer(level, printToConsole, raw, category, fields, ctx, format, args);
+  else
+    submitMessageSync(level, printToConsole, raw, category, fields, ctx, format, args);
+}
+
+static void submitMessage(minilog::eLogLevel level, ThreadLogContext* ctx, const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  submitMessageV(level, true, false, nullptr, {}, ctx, format, args);
+  va_end(args);
+}
+
+/// self-instrumentation
+
+unsigned long long minilog::getLatencyBucketNs(unsigned int bucket) {
+  if (bucket < 8)
+    return bucket;
+
+  const uint32_t msb = bucket / 8 + 2;
+
+  return (8ull + bucket % 8) << (msb - 3);
+}
+
+minilog::Stats minilog::getStats() {
+  Stats stats;
+
+  for (const StatsShard& s : statsShards) {
+    for (int i = 0; i <= FatalError; i++)
+      stats.numMessages[i] += s.numMessages[i].load(std::memory_order_relaxed);
+    stats.numDropped += s.numDropped.load(std::memory_order_relaxed);
+    stats.numSuppressed += s.numSuppressed.load(std::memory_order_relaxed);
+    stats.mutexWaitNs += s.mutexWaitNs.load(std::memory_order_relaxed);
+    stats.queueWaitNs += s.queueWaitNs.load(std::memory_order_relaxed);
+    for (uint32_t i = 0; i != Stats::kNumLatencyBuckets; i++)
+      stats.latencyHistogram[i] += s.latency[i].load(std::memory_order_relaxed);
+  }
+
+  stats.numBytesWritten = statsBytesWritten.load(std::memory_order_relaxed);
+  stats.numFlushes = statsNumFlushes.load(std::memory_order_relaxed);
+
+  unsigned long long numCalls = 0;
+
+  for (unsigned long long n : stats.latencyHistogram)
+    numCalls += n;
+
+  // the upper bound of the bucket where the percentile falls
+  auto getPercentile = [&stats, numCalls](double p) -> unsigned long long {
+    const unsigned long long rank = p < 1.0 ? (unsigned long long)(double(numCalls) * p) : numCalls - 1;
+    unsigned long long count = 0;
+    for (uint32_t i = 0; i != Stats::kNumLatencyBuckets; i++) {
+      count += stats.latencyHistogram[i];
+      if (count > rank)
+        return getLatencyBucketNs(i + 1) - 1;
+    }
+    return 0;
+  };
+
+  if (numCalls) {
+    stats.latencyP50Ns = getPercentile(0.5);
+    stats.latencyP99Ns = getPercentile(0.99);
+    stats.latencyP999Ns = getPercentile(0.999);
+    stats.latencyMaxNs = getPercentile(1.0);
+  }
+
+  return stats;
+}
+
+void minilog::resetStats() {
+  for (StatsShard& s : statsShards) {
+    for (std::atomic<uint64_t>& n : s.numMessages)
+      n.store(0, std::memory_order_relaxed);
+    s.numDropped.store(0, std::memory_order_relaxed);
+    s.numSuppressed.store(0, std::memory_order_relaxed);
+    s.mutexWaitNs.store(0, std::memory_order_relaxed);
+    s.queueWaitNs.store(0, std::memory_order_relaxed);
+    for (std::atomic<uint64_t>& n : s.latency)
+      n.store(0, std::memory_order_relaxed);
+  }
+
+  statsBytesWritten.store(0, std::memory_order_relaxed);
+  statsNumFlushes.store(0, std::memory_order_relaxed);
+}
+
+// LogConfig::statsReportIntervalSec and LogConfig::statsReportAtExit
+static void reportStats(ThreadLogContext* ctx) {
+  const minilog::Stats s = minilog::getStats();
+
+  unsigned long long numMessages = 0;
+
+  for (unsigned long long n : s.numMessages)
+    numMessages += n;
+
+  submitMessage(minilog::Log,
+                ctx,
+                "minilog: stats: %llu messages (P %llu, D %llu, L %llu, W %llu, F %llu), %llu bytes, %llu flushes, %llu dropped, "
+                "%llu suppressed, waits: mutex %.3f ms, queue %.3f ms, latency: p50 %llu ns, p99 %llu ns, p99.9 %llu ns, max %llu ns",
+                numMessages,
+                s.numMessages[minilog::Paranoid],
+                s.numMessages[minilog::Debug],
+                s.numMessages[minilog::Log],
+                s.numMessages[minilog::Warning],
+                s.numMessages[minilog::FatalError],
+                s.numBytesWritten,
+                s.numFlushes,
+                s.numDropped,
+                s.numSuppressed,
+                double(s.mutexWaitNs) / 1e6,
+                double(s.queueWaitNs) / 1e6,
+                s.latencyP50Ns,
+                s.latencyP99Ns,
+                s.latencyP999Ns,
+                s.latencyMaxNs);
+}
+
+// one thread at a time writes the periodic summary
+static void reportStatsIfDue(ThreadLogContext* ctx, uint64_t now) {
+  uint64_t next = nextStatsReportTicks.load(std::memory_order_relaxed);
+
+  if (now < next || !nextStatsReportTicks.compare_exchange_strong(next, now + statsReportIntervalTicks))
+    return;
+
+  reportStats(ctx);
+}
+
+// writes out the backtrace ring of the calling thread (oldest messages first) before a message >= LogConfig::backtraceTriggerLevel
+static void dumpBacktrace(minilog::eLogLevel level, ThreadLogContext* ctx) {
+  const uint64_t count = ctx->backtraceCount;
+  const uint32_t num = uint32_t(count < ctx->backtraceCapacity ? count : ctx->backtraceCapacity);
+
+  ctx->backtraceCount = 0;
+
+  submitMessage(level, ctx, "minilog: backtrace of the last %u messages on this thread:", num);
+
+  for (uint64_t i = count - num; i != count; i++)
+    submitBacktraceMessage(ctx->backtrace[i % ctx->backtraceCapacity], ctx);
+
+  submitMessage(level, ctx, "minilog: end of backtrace");
+}
+
+// 64-bit FNV-1a
+static uint64_t hashBytes(const void* data, size_t size, uint64_t hash = 14695981039346656037ull) {
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  for (size_t i = 0; i != size; i++)
+    hash = (hash ^ bytes[i]) * 1099511628211ull;
+  return hash;
+}
+
+static void flushRepeatedMessages(ThreadLogContext* ctx) {
+  const uint32_t numRepeats = ctx->numRepeats.exchange(0, std::memory_order_relaxed);
+
+  if (numRepeats)
+    submitMessage(ctx->lastLevel.load(std::memory_order_relaxed), ctx, "minilog: last message repeated %u times", numRepeats);
+}
+
+// one thread at a time reports the repeats pending on other threads for longer than the report interval (all of them if
+// `force`), so a thread which stops logging in the middle of a series does not keep its count forever
+static void reportRepeatedMessages(ThreadLogContext* ctx, uint64_t now, bool force) {
+  uint64_t next = nextRepeatsReportTicks.load(std::memory_order_relaxed);
+
+  if (!force && (now < next || !nextRepeatsReportTicks.compare_exchange_strong(next, now + suppressedReportIntervalTicks)))
+    return;
+
+  struct Pending {
+    const char* threadName;
+    uint64_t threadId;
+    minilog::eLogLevel level;
+    uint32_t numRepeats;
+  };
+  std::vector<Pending> pending;
+
+  {
+    std::lock_guard<std::mutex> lock(coalescingMutex);
+    for (ThreadLogContext* other : coalescingContexts) {
+      if (other == ctx || !other->numRepeats.load(std::memory_order_relaxed))
+        continue;
+      if (!force && now - other->firstRepeatTicks.load(std::memory_order_relaxed) < suppressedReportIntervalTicks)
+        continue;
+      const uint32_t numRepeats = other->numRepeats.exchange(0, std::memory_order_relaxed);
+      if (numRepeats)
+        pending.push_back({other->threadName, other->threadId, other->lastLevel.load(std::memory_order_relaxed), numRepeats});
+    }
+  }
+
+  if (force)
+    flushRepeatedMessages(ctx);
+
+  // submitted on behalf of this thread, the thread the series belongs to may be logging right now
+  for (const Pending& p : pending) {
+    if (p.threadName)
+      submitMessage(p.level, ctx, "minilog: last message of thread %s repeated %u times", p.threadName, p.numRepeats);
+    else
+      submitMessage(p.level, ctx, "minilog: last message of thread %llu repeated %u times", (unsigned long long)p.threadId, p.numRepeats);
+  }
+}
+
+// LogConfig::coalesceDuplicates: returns true if the message is the same as the previous one of this thread (format + arguments)
+static bool isRepeatedMessage(ThreadLogContext* ctx, minilog::eLogLevel level, FieldList fields, const char* format, va_list args) {
+  if (!ctx->isCoalescing) {
+    std::lock_guard<std::mutex> lock(coalescingMutex);
+    coalescingContexts.push_back(ctx);
+    ctx->isCoalescing = true;
+  }
+
+  // only a message with the format string and level of the previous one can repeat it, the arguments of anything else are
+  // not captured; a series is recognized once its second message has been hashed
+  uint64_t hash = 0;
+  bool isHashed = false;
+
+  if (format == ctx->lastFormat && level == ctx->lastLevel.load(std::memory_order_relaxed)) {
+    uint8_t argsBuffer[1024];
+
+    va_list argsCopy;
+    va_copy(argsCopy, args);
+    const int argsSize = captureFormatArgs(argsBuffer, argsBuffer + sizeof(argsBuffer), format, argsCopy);
+    va_end(argsCopy);
+
+    // arguments which cannot be captured are never coalesced
+    if (argsSize >= 0) {
+      hash = hashBytes(argsBuffer, size_t(argsSize), hashBytes(&format, sizeof(format)));
+      for (const minilog::Field& f : fields) {
+        hash = hashBytes(&f.key, sizeof(f.key), hash);
+        hash = hashBytes(&f.type, sizeof(f.type), hash);
+        if (f.type == minilog::Field::Type_String)
+          hash = hashBytes(f.value.str.s, f.value.str.length, hash);
+        else if (f.type == minilog::Field::Type_Bool)
+          hash = hashBytes(&f.value.b, sizeof(f.value.b), hash);
+        else
+          hash = hashBytes(&f.value.u, sizeof(f.value.u), hash);
+      }
+      isHashed = true;
+    }
+  }
+
+  if (isHashed && ctx->isLastHashed && hash == ctx->lastHash) {
+    const uint64_t now = getCurrentTicks();
+    if (!ctx->numRepeats.fetch_add(1, std::memory_order_relaxed))
+      ctx->firstRepeatTicks.store(now, std::memory_order_relaxed);
+    countSuppressed();
+    // a long series of repeats is reported periodically
+    if (now - ctx->firstRepeatTicks.load(std::memory_order_relaxed) >= suppressedReportIntervalTicks)
+      flushRepeatedMessages(ctx);
+    return true;
+  }
+
+  flushRepeatedMessages(ctx);
+
+  ctx->lastFormat = format;
+  ctx->lastLevel.store(level, std::memory_order_relaxed);
+  ctx->lastHash = hash;
+  ctx->isLastHashed = isHashed;
+
+  return false;
+}
+
+// LogConfig::rateLimitPerSecond: a token bucket per call site in its GCRA form, i.e. a single atomic "theoretical arrival time"
+static bool isRateLimited(const char* site, uint64_t now) {
+  const uint32_t hash = uint32_t((uintptr_t(site) >> 3) * 2654435761u);
+
+  for (uint32_t i = 0; i != kMaxRateLimitSites; i++) {
+    RateLimitSite& s = rateLimitSites[(hash + i) & (kMaxRateLimitSites - 1)];
+
+    const char* key = s.site.load(std::memory_order_acquire);
+
+    if (!key && s.site.compare_exchange_strong(key, site, std::memory_order_acq_rel))
+      key = site;
+
+    if (key != site)
+      continue;
+
+    uint64_t tat = s.tat.load(std::memory_order_relaxed);
+
+    for (;;) {
+      const uint64_t start = tat > now ? tat : now;
+      if (start - now > rateLimitToleranceTicks) {
+        s.numSuppressed.fetch_add(1, std::memory_order_relaxed);
+        countSuppressed();
+        return true;
+      }
+      if (s.tat.compare_exchange_weak(tat, start + rateLimitIntervalTicks, std::memory_order_relaxed))
+        return false;
+    }
+  }
+
+  // too many call sites
+  return false;
+}
+
+// one thread at a time reports the messages dropped by the rate limit since the last report
+static void reportRateLimitedMessages(ThreadLogContext* ctx, uint64_t now, bool force) {
+  uint64_t next = nextSuppressedReportTicks.load(std::memory_order_relaxed);
+
+  if (!force && (now < next || !nextSuppressedReportTicks.compare_exchange_strong(next, now + suppressedReportIntervalTicks)))
+    return;
+
+  for (RateLimitSite& s : rateLimitSites) {
+    const char* site = s.site.load(std::memory_order_acquire);
+    if (!site || !s.numSuppressed.load(std::memory_order_relaxed))
+      continue;
+    const uint64_t numSuppressed = s.numSuppressed.exchange(0, std::memory_order_relaxed);
+    submitMessage(minilog::Warning, ctx, "minilog: %llu messages dropped by the rate limit: %s", (unsigned long long)numSuppressed, site);
+  }
+}
+
+// called by deinitialize() so that nothing is lost silently
+static void flushSuppressedMessages() {
+  if (config.coalesceDuplicates)
+    reportRepeatedMessages(getThreadLogContext(), getCurrentTicks(), true);
+
+  if (config.rateLimitPerSecond)
+    reportRateLimitedMessages(getThreadLogContext(), getCurrentTicks(), true);
+}
+
+// log() and logf() after the level check; `site` identifies the call site for LogConfig::rateLimitPerSecond
+static void logMessage(minilog::eLogLevel level,
+                       const minilog::Category* category,
+                       FieldList fields,
+                       const char* site,
+                       const char* format,
+                       va_list args) {
+  const StatsCallTimer timer;
+
+  ThreadLogContext* ctx = getThreadLogContext();
+
+  if (statsReportIntervalTicks && timer.getStartTicks() >= nextStatsReportTicks.load(std::memory_order_relaxed))
+    reportStatsIfDue(ctx, timer.getStartTicks());
+
+  if (config.backtraceSize && !category && level < minOutputLevel.load(std::memory_order_relaxed)) {
+    storeBacktraceMessage(level, ctx, fields, format, args);
+    return;
+  }
+
+  if (config.coalesceDuplicates) {
+    reportRepeatedMessages(ctx, getCurrentTicks(), false);
+    if (isRepeatedMessage(ctx, level, fields, format, args))
+      return;
+  }
+
+  if (config.rateLimitPerSecond) {
+    const uint64_t now = getCurrentTicks();
+    reportRateLimitedMessages(ctx, now, false);
+    if (isRateLimited(site, now))
+      return;
+  }
+
+  if (config.backtraceSize && ctx->backtraceCount && level >= config.backtraceTriggerLevel)
+    dumpBacktrace(level, ctx);
+
+  if (ctx->procsNestingLevel > 0)
+    ctx->hasLogsOnThisLevel[ctx->procsNestingLevel] = true;
+
+  submitMessageV(level, true, false, category, fields, ctx, format, args);
+}
+
+static void logMessagef(minilog::eLogLevel level, const char* site, const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  logMessage(level, nullptr, {}, site, format, args);
+  va_end(args);
+}
+
+void minilog::log(eLogLevel level, const char* format, va_list args) {
+  if (isLogLevelEnabled(level))
+    logMessage(level, nullptr, {}, format, format, args);
+}
+
+void minilog::log(Category* category, eLogLevel level, const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  log(category, level, format, args);
+  va_end(args);
+}
+
+void minilog::log(Category* category, eLogLevel level, const char* format, va_list args) {
+  if (isLogLevelEnabled(category, level))
+    logMessage(level, category, {}, format, format, args);
+}
+
+void minilog::log(eLogLevel level, std::initializer_list<Field> fields, const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  log(level, fields, format, args);
+  va_end(args);
+}
+
+void minilog::log(eLogLevel level, std::initializer_list<Field> fields, const char* format, va_list args) {
+  if (isLogLevelEnabled(level))
+    logMessage(level, nullptr, fields, format, format, args);
+}
+
+void minilog::log(Category* category, eLogLevel level, std::initializer_list<Field> fields, const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  log(category, level, fields, format, args);
+  va_end(args);
+}
+
+void minilog::log(Category* category, eLogLevel level, std::initializer_list<Field> fields, const char* format, va_list args) {
+  if (isLogLevelEnabled(category, level))
+    logMessage(level, category, fields, format, format, args);
+}
+
+void minilog::detail::FormatBuffer::grow(size_t length) {
+  const size_t used = size_t(cur_ - begin_);
+
+  if (!overflow_) {
+    OverflowArena& arena = getThreadLogContext()->overflow[2];
+    // a custom Formatter may call logf() itself
+    ownsOverflow_ = arena.inUse;
+    overflow_ = ownsOverflow_ ? new OverflowArena : &arena;
+    static_cast<OverflowArena*>(overflow_)->inUse = true;
+  }
+
+  OverflowArena& arena = *static_cast<OverflowArena*>(overflow_);
+
+  begin_ = growOverflowArena(arena, begin_, used, 2 * (used + length + 1));
+  cur_ = begin_ + used;
+  end_ = begin_ + arena.size - 1;
+}
+
+void minilog::detail::FormatBuffer::release() {
+  if (ownsOverflow_)
+    delete static_cast<OverflowArena*>(overflow_);
+  else
+    releaseOverflowArena(*static_cast<OverflowArena*>(overflow_));
+}
+
+void minilog::detail::logString(eLogLevel level, const char* site, const char* msg) {
+  if (isLogLevelEnabled(level))
+    logMessagef(level, site, kTextFormat, msg);
+}
+
+void minilog::logRaw(eLogLevel level, const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  logRaw(level, format, args);
+  va_end(args);
+}
+
+void minilog::logRaw(eLogLevel level, const char* format, va_list args) {
+  logRaw(level, {}, format, args);
+}
+
+void minilog::logRaw(eLogLevel level, std::initializer_list<Field> fields, const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  logRaw(level, fields, format, args);
+  va_end(args);
+}
+
+void minilog::logRaw(eLogLevel level, std::initializer_list<Field> fields, const char* format, va_list args) {
+#if defined(MINILOG_RAW_OUTPUT)
+  const bool printToConsole = true;
+#else
+  const bool printToConsole = false;
+#endif // MINILOG_RAW_OUTPUT
+
+  const StatsCallTimer timer;
+
+  ThreadLogContext* ctx = getThreadLogContext();
+
+  if (ctx->procsNestingLevel > 0)
+    ctx->hasLogsOnThisLevel[ctx->procsNestingLevel] = true;
+
+  submitMessageV(level, printToConsole, true, nullptr, fields, ctx, format, args);
+}
+
+void MessageRing::init(uint32_t capacity, minilog::eQueueFullPolicy policy) {
+  capacity_ = 2;
+  while (capacity_ < capacity)
+    capacity_ <<= 1;
+  mask_ = capacity_ - 1;
+  policy_ = policy;
+
+  memory_ = static_cast<uint8_t*>(::operator new(capacity_ * kSlotSize, std::align_val_t(kCacheLineSize)));
+
+  for (uint64_t i = 0; i != capacity_; i++) {
+    Slot* slot = new (getSlot(i)) Slot;
+    slot->sequence.store(i, std::memory_order_relaxed);
+  }
+
+  head_.store(0, std::memory_order_relaxed);
+  tail_.store(0, std::memory_order_relaxed);
+  numDropped_.store(0, std::memory_order_relaxed);
+}
+
+void MessageRing::destroy() {
+  if (!memory_)
+    return;
+
+  ::operator delete(memory_, std::align_val_t(kCacheLineSize));
+
+  memory_ = nullptr;
+}
+
+bool MessageRing::isEmpty() const {
+  const uint64_t pos = head_.load(std::memory_order_relaxed);
+
+  return getSlot(pos)->sequence.load(std::memory_order_acquire) != pos + 1;
+}
+
+MessageRing::Slot* MessageRing::tryClaim() {
+  uint64_t pos = tail_.load(std::memory_order_relaxed);
+
+  for (;;) {
+    Slot* slot = getSlot(pos);
+    const int64_t diff = int64_t(slot->sequence.load(std::memory_order_acquire)) - int64_t(pos);
+    if (diff == 0) {
+      if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+        slot->position = pos;
+        return slot;
+      }
+    } else if (diff < 0) {
+      return nullptr; // the ring is full
+    } else {
+      pos = tail_.load(std::memory_order_relaxed);
+    }
+  }
+}
+
+MessageRing::Slot* MessageRing::consume() {
+  uint64_t pos = head_.load(std::memory_order_relaxed);
+
+  for (;;) {
+    Slot* slot = getSlot(pos);
+    const int64_t diff = int64_t(slot->sequence.load(std::memory_order_acquire)) - int64_t(pos + 1);
+    if (diff == 0) {
+      if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+        slot->position = pos;
+        return slot;
+      }
+    } else if (diff < 0) {
+      return nullptr; // nothing published yet
+    } else {
+      pos = head_.load(std::memory_order_relaxed);
+    }
+  }
+}
+
+bool MessageRing::dropOldest(bool lowPriorityOnly) {
+  if (lowPriorityOnly) {
+    const uint64_t pos = head_.load(std::memory_order_relaxed);
+    Slot* slot = getSlot(pos);
+    if (slot->sequence.load(std::memory_order_acquire) != pos + 1 || slot->level.load(std::memory_order_relaxed) > minilog::Debug)
+      return false;
+  }
+
+  Slot* slot = consume();
+
+  if (!slot)
+    return false;
+
+  deleteSpilledText(slot, slotText(slot));
+  release(slot);
+  numDropped_.fetch_add(1, std::memory_order_relaxed);
+  countDropped();
+
+  return true;
+}
+
+MessageRing::Slot* MessageRing::claim(minilog::eLogLevel level) {
+  StatsWaitTimer wait;
+
+  for (;;) {
+    if (Slot* slot = tryClaim()) {
+      slot->level.store(uint8_t(level), std::memory_order_relaxed);
+      return slot;
+    }
+
+    switch (policy_) {
+    case minilog::QueueFull_Block:
+      break;
+    case minilog::QueueFull_DropNewest:
+      numDropped_.fetch_add(1, std::memory_order_relaxed);
+      countDropped();
+      return nullptr;
+    case minilog::QueueFull_DropOldest:
+      if (dropOldest(false))
+        continue;
+      break;
+    case minilog::QueueFull_DropLowPriority:
+      if (level <= minilog::Debug) {
+        numDropped_.fetch_add(1, std::memory_order_relaxed);
+        countDropped();
+        return nullptr;
+      }
+      if (dropOldest(true))
+        continue;
+      break;
+    }
+
+    wait.start();
+    std::this_thread::yield();
+  }
+}
+
+void AsyncQueue::start(uint32_t capacity, minilog::eQueueFullPolicy policy) {
+  ring_.init(capacity, policy);
+  numDroppedReported_ = 0;
+  stopRequested_.store(false);
+  writerThread_ = std::thread([this]() { writerThreadProc(); });
+}
+
+void AsyncQueue::stop() {
+  if (!writerThread_.joinable())
+    return;
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopRequested_.store(true);
+  }
+  cv_.notify_one();
+  writerThread_.join();
+
+  ring_.destroy();
+}
+
+void AsyncQueue::publish(MessageRing::Slot* slot) {
+  ring_.publish(slot);
+
+  // pairs with the fence in writerThreadProc(): either the writer sees the slot or we see it sleeping
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+
+  if (writerSleeping_.load(std::memory_order_relaxed)) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    cv_.notify_one();
+  }
+}
+
+void AsyncQueue::reportDroppedMessages() {
+  const uint64_t numDropped = ring_.getNumDropped();
+
+  if (numDropped == numDroppedReported_)
+    return;
+
+  char buffer[128];
+  snprintf(buffer,
+           sizeof(buffer),
+           "minilog: %llu messages dropped, the async queue is full",
+           (unsigned long long)(numDropped - numDroppedReported_));
+  numDroppedReported_ = numDropped;
+
+  const ThreadLogContext* ctx = getThreadLogContext();
+
+  LogMessage m;
+  m.level = minilog::Warning;
+  m.threadName = ctx->threadName;
+  m.threadId = ctx->threadId;
+  m.threadIndex = ctx->threadIndex;
+  m.timeStamp = getTimeStamp();
+  m.text = buffer;
+  m.msg = buffer;
+  dispatchMessage(m);
+}
+
+void AsyncQueue::writerThreadProc() {
+  minilog::threadNameSet("minilog");
+
+  OverflowArena overflow; // deferred formatting of long messages happens here
+
+  // wake up often enough to write out staged messages of FileBackend_Batched and FileBackend_IoUring
+  const bool isStaging = config.fileBackend == minilog::FileBackend_Batched || config.fileBackend == minilog::FileBackend_IoUring;
+  const uint32_t sleepMs = isStaging && config.batchFlushIntervalMs < 100 ? config.batchFlushIntervalMs + 1 : 100;
+
+  for (;;) {
+    if (ring_.isEmpty()) {
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        writerSleeping_.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (ring_.isEmpty()) {
+          if (stopRequested_.load())
+            break;
+          cv_.wait_for(lock, std::chrono::milliseconds(sleepMs));
+        }
+        writerSleeping_.store(false, std::memory_order_relaxed);
+      }
+      std::lock_guard<std::mutex> lock(logMutex);
+      logFile.flushIfDue();
+      if (config.categoryControlFile)
+        reloadCategoryLevelsIfDue();
+      continue;
+    }
+
+    std::lock_guard<std::mutex> lock(logMutex);
+
+    consoleWriter.beginBatch();
+
+    while (MessageRing::Slot* slot = ring_.consume()) {
+      const minilog::eLogLevel level = minilog::eLogLevel(slot->level.load(std::memory_order_relaxed));
+      dispatchQueuedMessage(slot, level, MessageRing::slotText(slot), overflow);
+      ring_.release(slot);
+    }
+
+    reportDroppedMessages();
+
+    consoleWriter.endBatch();
+  }
+
+  std::lock_guard<std::mutex> lock(logMutex);
+
+  reportDroppedMessages();
+}
+
+ThreadBuffer::ThreadBuffer(uint32_t size) : size_(size) {
+  data_ = static_cast<char*>(::operator new(size, std::align_val_t(alignof(Record))));
+}
+
+ThreadBuffer::~ThreadBuffer() {
+  ::operator delete(data_, std::align_val_t(alignof(Record)));
+}
+
+ThreadBuffer::Record* ThreadBuffer::beginWrite() {
+  const uint64_t head = head_.load(std::memory_order_relaxed);
+  const uint32_t offset = uint32_t(head & (size_ - 1));
+  // a record never wraps around: skip the end of the ring if it cannot take the largest record
+  const uint32_t skip = size_ - offset < kMaxRecordSize ? size_ - offset : 0;
+
+  if (head + skip + kMaxRecordSize - cachedTail_ > size_) {
+    cachedTail_ = tail_.load(std::memory_order_acquire);
+    if (head + skip + kMaxRecordSize - cachedTail_ > size_)
+      return nullptr;
+  }
+
+  if (skip) {
+    reinterpret_cast<Record*>(data_ + offset)->size = 0;
+    pendingHead_ = head + skip;
+    return reinterpret_cast<Record*>(data_);
+  }
+
+  pendingHead_ = head;
+  return reinterpret_cast<Record*>(data_ + offset);
+}
+
+void ThreadBuffer::endWrite(Record* r, uint32_t textSize) {
+  r->size = (uint32_t(sizeof(Record)) + textSize + uint32_t(alignof(Record)) - 1) & ~uint32_t(alignof(Record) - 1);
+  head_.store(pendingHead_ + r->size, std::memory_order_release);
+}
+
+void ThreadBuffer::snapshot() {
+  limit_ = head_.load(std::memory_order_acquire);
+}
+
+ThreadBuffer::Record* ThreadBuffer::peek() {
+  for (;;) {
+    const uint64_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail == limit_)
+      return nullptr;
+    Record* r = reinterpret_cast<Record*>(data_ + (tail & (size_ - 1)));
+    if (r->size)
+      return r;
+    // the producer skipped the end of the ring
+    tail_.store(tail + (size_ - (tail & (size_ - 1))), std::memory_order_release);
+  }
+}
+
+void ThreadBuffer::pop(Record* r) {
+  tail_.store(tail_.load(std::memory_order_relaxed) + r->size, std::memory_order_release);
+}
+
+void ThreadBufferCollector::start(uint32_t bufferSize, uint32_t flushIntervalMs, minilog::eQueueFullPolicy policy) {
+  // a power of two which takes a few records of the largest size
+  uint32_t size = 64 * 1024;
+  static_assert(64 * 1024 >= 4 * ThreadBuffer::kMaxRecordSize, "");
+  while (size < bufferSize && size < (1u << 30))
+    size *= 2;
+  bufferSize_ = size;
+  flushIntervalMs_ = flushIntervalMs ? flushIntervalMs : 1;
+  policy_ = policy;
+  stopRequested_.store(false);
+  thread_ = std::thread([this]() { threadProc(); });
+}
+
+void ThreadBufferCollector::stop() {
+  if (!thread_.joinable())
+    return;
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopRequested_.store(true);
+  }
+  cv_.notify_one();
+  thread_.join();
+
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  // threads still alive get new buffers if the thread buffers are started again
+  generation_.fetch_add(1, std::memory_order_acq_rel);
+
+  for (ThreadBuffer* b : buffers_)
+    delete b;
+  buffers_.clear();
+}
+
+ThreadBuffer::Record* ThreadBufferCollector::beginWrite(ThreadBuffer* buffer, minilog::eLogLevel level) {
+  // only the collector removes records, so the producer cannot drop queued ones: QueueFull_DropLowPriority keeps the
+  // second half of the ring for messages above Debug, and QueueFull_DropOldest drops the new message like QueueFull_DropNewest
+  const bool isLowPriority = policy_ == minilog::QueueFull_DropLowPriority && level <= minilog::Debug;
+
+  ThreadBuffer::Record* r = isLowPriority && buffer->isHalfFullNow() ? nullptr : buffer->beginWrite();
+  StatsWaitTimer wait;
+
+  while (!r) {
+    if (isLowPriority || policy_ == minilog::QueueFull_DropNewest || policy_ == minilog::QueueFull_DropOldest) {
+      buffer->numDropped.fetch_add(1, std::memory_order_relaxed);
+      countDropped();
+      return nullptr;
+    }
+    wait.start();
+    wake();
+    std::this_thread::yield();
+    r = buffer->beginWrite();
+  }
+
+  return r;
+}
+
+ThreadBuffer* ThreadBufferCollector::getBuffer(ThreadLogContext* ctx) {
+  const uint32_t generation = generation_.load(std::memory_order_acquire);
+
+  if (ctx->threadBuffer && ctx->threadBufferGeneration == generation)
+    return ctx->threadBuffer;
+
+  ThreadBuffer* b = new ThreadBuffer(bufferSize_);
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    buffers_.push_back(b);
+  }
+
+  ctx->threadBuffer = b;
+  ctx->threadBufferGeneration = generation;
+
+  return b;
+}
+
+void ThreadBufferCollector::close(ThreadBuffer* buffer, uint32_t generation) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  // stop() has deleted the buffer already
+  if (generation != generation_.load(std::memory_order_relaxed))
+    return;
+  buffer->closed.store(true, std::memory_order_release);
+  cv_.notify_one();
+}
+
+void ThreadBufferCollector::wake() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  cv_.notify_one();
+}
+
+void ThreadBufferCollector::threadProc() {
+  minilog::threadNameSet("minilog");
+
+  OverflowArena overflow; // deferred formatting of long messages happens here
+
+  for (;;) {
+    bool stop = false;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (!stopRequested_.load()) {
+        sleeping_.store(true, std::memory_order_relaxed);
+        cv_.wait_for(lock, std::chrono::milliseconds(flushIntervalMs_));
+        sleeping_.store(false, std::memory_order_relaxed);
+      }
+      stop = stopRequested_.load();
+      collecting_ = buffers_;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(logMutex);
+      consoleWriter.beginBatch();
+      collect(overflow);
+      consoleWriter.endBatch();
+      logFile.flushIfDue();
+      if (config.categoryControlFile)
+        reloadCategoryLevelsIfDue();
+    }
+
+    // buffers of exited threads go away once they are empty
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      buffers_.erase(std::remove_if(buffers_.begin(),
+                                    buffers_.end(),
+                                    [](ThreadBuffer* b) {
+                                      if (!b->closed.load(std::memory_order_acquire) || !b->isEmpty())
+                                        return false;
+                                      delete b;
+                                      return true;
+                                    }),
+                     buffers_.end());
+    }
+
+    if (stop)
+      break;
+  }
+}
+
+void ThreadBufferCollector::collect(OverflowArena& overflow) {
+  for (ThreadBuffer* b : collecting_)
+    b->snapshot();
+
+  // merge the buffers by time stamp: every buffer is ordered already, pick the oldest head record each time
+  for (;;) {
+    ThreadBuffer* oldest = nullptr;
+    ThreadBuffer::Record* oldestRecord = nullptr;
+    for (ThreadBuffer* b : collecting_) {
+      ThreadBuffer::Record* r = b->peek();
+      if (r && (!oldestRecord || r->timeStamp < oldestRecord->timeStamp)) {
+        oldest = b;
+        oldestRecord = r;
+      }
+    }
+    if (!oldest)
+      break;
+    dispatchQueuedMessage(oldestRecord, oldestRecord->level, ThreadBuffer::recordText(oldestRecord), overflow);
+    oldest->pop(oldestRecord);
+  }
+
+  for (ThreadBuffer* b : collecting_) {
+    const uint64_t numDropped = b->numDropped.load(std::memory_order_relaxed);
+    if (numDropped == b->numDroppedReported)
+      continue;
+
+    char text[128];
+    snprintf(text,
+             sizeof(text),
+             "minilog: %llu messages dropped, a thread buffer is full",
+             (unsigned long long)(numDropped - b->numDroppedReported));
+    b->numDroppedReported = numDropped;
+
+    const ThreadLogContext* ctx = getThreadLogContext();
+
+    LogMessage m;
+    m.level = minilog::Warning;
+    m.threadName = ctx->threadName;
+    m.threadId = ctx->threadId;
+    m.threadIndex = ctx->threadIndex;
+    m.timeStamp = getTimeStamp();
+    m.text = text;
+    m.msg = text;
+    dispatchMessage(m);
+  }
+}
+
+ThreadLogContext::~ThreadLogContext() {
+  if (isCoalescing) {
+    {
+      std::lock_guard<std::mutex> lock(coalescingMutex);
+      coalescingContexts.erase(std::find(coalescingContexts.begin(), coalescingContexts.end(), this));
+    }
+    // the thread exits in the middle of a series
+    flushRepeatedMessages(this);
+  }
+
+  if (threadBuffer)
+    threadBufferCollector.close(threadBuffer, threadBufferGeneration);
+}
+
+// set while this thread runs callbacks: removing a callback from inside a callback must not wait for itself
+static thread_local bool isInsideCallback = false;
+
+CallbackRegistry::~CallbackRegistry() {
+  delete current_.load();
+
+  for (Retired& r : retired_)
+    delete r.snapshot;
+}
+
+const CallbackRegistry::Snapshot* CallbackRegistry::enter(uint32_t& counter) {
+  counter = epoch_.load() & 1;
+  readers_[counter].fetch_add(1);
+
+  // loaded after the counter is raised: a writer replacing this snapshot waits for (or observes) our counter
+  return current_.load();
+}
+
+void CallbackRegistry::invoke(minilog::eLogLevel level, const char* msg) {
+  if (!current_.load(std::memory_order_relaxed))
+    return;
+
+  uint32_t counter = 0;
+
+  if (const Snapshot* s = enter(counter)) {
+    const bool wasInsideCallback = isInsideCallback;
+    isInsideCallback = true;
+    for (uint32_t i = 0; i != s->num; i++) {
+      if (s->callbacks[i].funcs[level])
+        s->callbacks[i].funcs[level](s->callbacks[i].userData, msg);
+    }
+    isInsideCallback = wasInsideCallback;
+  }
+
+  leave(counter);
+}
+
+bool CallbackRegistry::has(minilog::eLogLevel level) {
+  if (!current_.load(std::memory_order_relaxed))
+    return false;
+
+  uint32_t counter = 0;
+  bool result = false;
+
+  if (const Snapshot* s = enter(counter)) {
+    for (uint32_t i = 0; i != s->num && !result; i++)
+      result = s->callbacks[i].funcs[level] != nullptr;
+  }
+
+  leave(counter);
+
+  return result;
+}
+
+bool CallbackRegistry::add(const minilog::LogCallback& cb) {
+  std::lock_guard<std::mutex> lock(writeMutex_);
+
+  const Snapshot* old = current_.load();
+
+  if (old && old->num >= kMaxCallbacks)
+    return false;
+
+  Snapshot* s = old ? new Snapshot(*old) : new Snapshot();
+  s->callbacks[s->num++] = cb;
+
+  retire(current_.exchange(s));
+
+  return true;
+}
+
+void CallbackRegistry::remove(void* userData) {
+  Snapshot* old = nullptr;
+
+  {
+    std::lock_guard<std::mutex> lock(writeMutex_);
+
+    const Snapshot* cur = current_.load();
+
+    for (uint32_t i = 0; cur && i != cur->num && !old; i++) {
+      if (cur->callbacks[i].userData == userData) {
+        Snapshot* s = nullptr;
+        if (cur->num > 1) {
+          s = new Snapshot(*cur);
+          s->callbacks[i] = s->callbacks[s->num - 1];
+          s->num--;
+        }
+        old = current_.exchange(s);
+      }
+    }
+
+    // a callback removing callbacks cannot wait for itself
+    if (!old || isInsideCallback) {
+      retire(old);
+      return;
+    }
+  }
+
+  // once removed, the callback is not running anywhere
+  synchronize();
+
+  delete old;
+}
+
+void CallbackRegistry::synchronize() {
+  // every reader which could have seen a replaced snapshot holds one of the counters since before it was replaced
+  for (uint32_t counter = 0; counter != 2; counter++) {
+    // new readers go to the other counter, so this one can drain
+    if ((epoch_.load() & 1) == counter)
+      epoch_.fetch_add(1);
+    while (readers_[counter].load())
+      std::this_thread::yield();
+  }
+}
+
+void CallbackRegistry::retire(Snapshot* snapshot) {
+  if (snapshot)
+    retired_.push_back({snapshot, {false, false}});
+
+  // new readers go to the other counter, so the current one can drain
+  epoch_.fetch_add(1);
+
+  const bool drained[2] = {readers_[0].load() == 0, readers_[1].load() == 0};
+
+  size_t n = 0;
+
+  for (Retired& r : retired_) {
+    r.drained[0] = r.drained[0] || drained[0];
+    r.drained[1] = r.drained[1] || drained[1];
+    if (r.drained[0] && r.drained[1])
+      delete r.snapshot;
+    else
+      retired_[n++] = r;
+  }
 
-    // clang-format off
-#if defined(MINILOG_RAW_OUTPUT)
-#	define FORMATSTR_THREAD_NAME "(%s):%s"
-#	define FORMATSTR_THREAD_ID   "(%llu):%s"
-#	define FORMATSTR_NO_THREAD   "%s"
-#else
-#	define FORMATSTR_THREAD_NAME "(%s):%s\n"
-#	define FORMATSTR_THREAD_ID   "(%llu):%s\n"
-#	define FORMATSTR_NO_THREAD   "%s\n"
-#endif
-    // clang-format on
+  retired_.resize(n);
+}
 
-#if OS_APPLE
-    if (config.coloredConsole) {
-      if (config.threadNames) {
-        if (ctx->threadName) {
-          os_log_with_type(OS_LOG_DEFAULT, logLevelToOsLogType(level), "(%{public}s):%{public}s", ctx->threadName, msg);
-        } else {
-          os_log_with_type(OS_LOG_DEFAULT, logLevelToOsLogType(level), "(%{public}llu):%{public}s", (unsigned long long)ctx->threadId, msg);
-        }
-      } else {
-        os_log_with_type(OS_LOG_DEFAULT, logLevelToOsLogType(level), "%{public}s", msg);
+void CallbackDispatcher::start(uint32_t capacity, minilog::eQueueFullPolicy policy) {
+  ring_.init(capacity, policy);
+  numDroppedReported_ = 0;
+  stopRequested_.store(false);
+  thread_ = std::thread([this]() { threadProc(); });
+}
+
+void CallbackDispatcher::stop() {
+  if (!thread_.joinable())
+    return;
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopRequested_.store(true);
+  }
+  cv_.notify_one();
+  thread_.join();
+
+  ring_.destroy();
+}
+
+void CallbackDispatcher::post(minilog::eLogLevel level, const char* msg) {
+  if (!callbackRegistry.has(level))
+    return;
+
+  MessageRing::Slot* slot = ring_.claim(level);
+
+  if (!slot)
+    return;
+
+  const size_t size = strlen(msg) + 1;
+
+  char* text = MessageRing::slotText(slot);
+
+  // longer messages are spilled to the heap, just like in writeQueuedMessage()
+  if (size <= MessageRing::kTextSize) {
+    memcpy(text, msg, size);
+    slot->flags = 0;
+  } else {
+    char* spilled = new char[size];
+    memcpy(spilled, msg, size);
+    memcpy(text, &spilled, sizeof(spilled));
+    slot->flags = MessageRing::Flag_Spilled;
+  }
+
+  ring_.publish(slot);
+
+  // pairs with the fence in threadProc(): either the dispatcher sees the slot or we see it sleeping
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+
+  if (sleeping_.load(std::memory_order_relaxed)) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    cv_.notify_one();
+  }
+}
+
+void CallbackDispatcher::threadProc() {
+  minilog::threadNameSet("minilog-callbacks");
+
+  for (;;) {
+    if (ring_.isEmpty()) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      sleeping_.store(true, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (ring_.isEmpty()) {
+        if (stopRequested_.load())
+          break;
+        cv_.wait_for(lock, std::chrono::milliseconds(100));
       }
+      sleeping_.store(false, std::memory_order_relaxed);
+      continue;
     }
-#endif // OS_APPLE
 
-    if (config.threadNames) {
-      if (ctx->threadName) {
-        printf(FORMATSTR_THREAD_NAME, ctx->threadName, msg);
-      } else {
-        printf(FORMATSTR_THREAD_ID, (unsigned long long)ctx->threadId, msg);
-      }
-    } else {
-      printf(FORMATSTR_NO_THREAD, msg);
+    while (MessageRing::Slot* slot = ring_.consume()) {
+      const char* text = MessageRing::slotText(slot);
+      const char* msg = text;
+      if (slot->flags & MessageRing::Flag_Spilled)
+        memcpy(&msg, text, sizeof(msg));
+      callbackRegistry.invoke(minilog::eLogLevel(slot->level.load(std::memory_order_relaxed)), msg);
+      MessageRing::deleteSpilledText(slot, text);
+      ring_.release(slot);
     }
 
-    if (config.coloredConsole) {
-#if OS_WINDOWS
-      SetConsoleTextAttribute(GetStdHandle(STD_OUTPUT_HANDLE), FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE);
-#else
-      printf("\033[0m");
-#endif // OS_WINDOWS
+    const uint64_t numDropped = ring_.getNumDropped();
+
+    if (numDropped != numDroppedReported_) {
+      char buffer[128];
+      snprintf(buffer,
+               sizeof(buffer),
+               "minilog: %llu messages dropped, the callback queue is full",
+               (unsigned long long)(numDropped - numDroppedReported_));
+      numDroppedReported_ = numDropped;
+      callbackRegistry.invoke(minilog::Warning, buffer);
     }
   }
+}
+
+ProfilerBuffer::~ProfilerBuffer() {
+  for (Event* chunk : chunks_)
+    delete[] chunk;
 
-#undef FORMATSTR_THREAD_NAME
-#undef FORMATSTR_THREAD_ID
-#undef FORMATSTR_NO_THREAD
+  for (uint32_t i = 0; i != numNames_; i++)
+    free(names_[i]);
 }
 
-void minilog::log(eLogLevel level, const char* format, ...) {
-  va_list args;
-  va_start(args, format);
-  log(level, format, args);
-  va_end(args);
+uint32_t ProfilerBuffer::internName(const char* name) {
+  // FNV-1a
+  uint32_t hash = 2166136261u;
+  for (const char* p = name; *p; p++)
+    hash = (hash ^ uint8_t(*p)) * 16777619u;
+
+  for (uint32_t i = hash & (kNameTableSize - 1);; i = (i + 1) & (kNameTableSize - 1)) {
+    const uint32_t index = nameTable_[i];
+    if (!index) {
+      if (numNames_ == kMaxNames)
+        return kMaxNames;
+      names_[numNames_] = strdup(name);
+      nameHashes_[numNames_] = hash;
+      nameTable_[i] = ++numNames_;
+      return numNames_ - 1;
+    }
+    if (nameHashes_[index - 1] == hash && !strcmp(names_[index - 1], name))
+      return index - 1;
+  }
 }
 
-void minilog::log(eLogLevel level, const char* format, va_list args) {
-  if (level < config.logLevel)
+void ProfilerBuffer::add(const char* name, uint64_t begin, uint64_t end) {
+  const uint64_t n = numEvents_.load(std::memory_order_relaxed);
+  const uint64_t chunk = n / kChunkSize;
+
+  if (chunk == kMaxChunks) {
+    numDropped_.fetch_add(1, std::memory_order_relaxed);
     return;
+  }
 
-  constexpr uint32_t kBufferLength = 8192;
+  if (!chunks_[chunk])
+    chunks_[chunk] = new Event[kChunkSize];
 
-  char buffer[kBufferLength];
-  const char* bufferEnd = buffer + kBufferLength - 1;
+  chunks_[chunk][n % kChunkSize] = {begin, end, internName(name)};
 
-  char* scratchBuf = config.writeTimeStamp ? config.writeTimeStamp(buffer, bufferEnd) : writeTimeStamp(buffer, bufferEnd);
-  scratchBuf = writeCurrentProcsNesting(scratchBuf, bufferEnd);
-  const char* msg = scratchBuf; // store where the actual message starts
+  numEvents_.store(n + 1, std::memory_order_release);
+}
 
-  vsnprintf(scratchBuf, uint32_t(bufferEnd - scratchBuf), format, args);
+static void addProfilerEvent(ThreadLogContext* ctx, const char* name, uint64_t begin, uint64_t end) {
+  const uint32_t generation = profilerGeneration.load(std::memory_order_acquire);
 
-  std::lock_guard<std::mutex> lock(logMutex);
+  if (ctx->profilerGeneration != generation) {
+    ctx->profilerBuffer = new ProfilerBuffer(ctx->threadName);
+    ctx->profilerGeneration = generation;
+    std::lock_guard<std::mutex> lock(profilerMutex);
+    profilerBuffers.push_back(ctx->profilerBuffer);
+  }
 
-  ThreadLogContext* ctx = getThreadLogContext();
+  ctx->profilerBuffer->add(name, begin, end);
+}
 
-  if (ctx->procsNestingLevel > 0)
-    ctx->hasLogsOnThisLevel[ctx->procsNestingLevel] = true;
+// called by deinitialize(), nothing else may be running
+static void stopProfiler() {
+  if (config.profiler && config.profilerFileName)
+    minilog::profilerExport(config.profilerFileName);
 
-  writeMessageToLog(level, buffer, ctx);
-  printMessageToConsole(level, buffer, ctx);
+  std::lock_guard<std::mutex> lock(profilerMutex);
 
-  invokeCallbacks(level, msg);
-}
+  for (ProfilerBuffer* buffer : profilerBuffers)
+    delete buffer;
 
-void minilog::logRaw(eLogLevel level, const char* format, ...) {
-  va_list args;
-  va_start(args, format);
-  logRaw(level, format, args);
-  va_end(args);
+  profilerBuffers.clear();
+
+  profilerGeneration.fetch_add(1, std::memory_order_release);
 }
 
-void minilog::logRaw(eLogLevel level, const char* format, va_list args) {
-  constexpr uint32_t kBufferLength = 8192;
+bool minilog::profilerExport(const char* fileName) {
+  FILE* file = fopen(fileName, "w");
 
-  char buffer[kBufferLength];
+  if (!file)
+    return false;
 
-  vsnprintf(buffer, kBufferLength - 1, format, args);
+  const double ticksPerUs = double(getTicksPerSecond()) / 1e6;
 
-  std::lock_guard<std::mutex> lock(logMutex);
+  std::vector<char> buffer(64 * 1024);
+  char* out = buffer.data();
 
-  ThreadLogContext* ctx = getThreadLogContext();
+  // writes out what has been collected if the next `size` bytes might not fit
+  auto reserve = [&buffer, &out, file](size_t size) {
+    if (size_t(buffer.data() + buffer.size() - out) >= size)
+      return;
+    fwrite(buffer.data(), 1, size_t(out - buffer.data()), file);
+    if (buffer.size() < size)
+      buffer.resize(size);
+    out = buffer.data();
+  };
 
-  if (ctx->procsNestingLevel > 0)
-    ctx->hasLogsOnThisLevel[ctx->procsNestingLevel] = true;
+  out = copyString(out, buffer.data() + buffer.size(), "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
 
-  writeMessageToLog(level, buffer, ctx);
+  std::lock_guard<std::mutex> lock(profilerMutex);
 
-#if defined(MINILOG_RAW_OUTPUT)
-  printMessageToConsole(level, buffer, ctx);
-#endif // MINILOG_RAW_OUTPUT
+  bool first = true;
+
+  for (size_t t = 0; t != profilerBuffers.size(); t++) {
+    const ProfilerBuffer* profilerBuffer = profilerBuffers[t];
+    const uint64_t numEvents = profilerBuffer->getNumEvents();
+    const char* threadName = profilerBuffer->getThreadName();
+
+    // JSON escaping makes a name up to 6 times longer
+    constexpr size_t kMaxEventLength = 160;
 
-  invokeCallbacks(level, buffer);
+    if (threadName) {
+      const size_t length = strlen(threadName);
+      reserve(6 * length + kMaxEventLength);
+      const char* end = buffer.data() + buffer.size();
+      out += snprintf(out,
+                      size_t(end - out),
+                      "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":",
+                      first ? "" : ",",
+                      unsigned(t + 1));
+      out = writeJSONString(out, end, threadName, length);
+      out = copyString(out, end, "}}");
+      first = false;
+    }
+
+    for (uint64_t i = 0; i != numEvents; i++) {
+      const ProfilerBuffer::Event& e = profilerBuffer->getEvent(i);
+      const char* name = profilerBuffer->getName(e.nameIndex);
+      const size_t length = getProcNameLength(name, strlen(name));
+      reserve(6 * length + kMaxEventLength);
+      const char* end = buffer.data() + buffer.size();
+      out = copyString(out, end, first ? "\n{\"name\":" : ",\n{\"name\":");
+      out = writeJSONString(out, end, name, length);
+      out += snprintf(out,
+                      size_t(end - out),
+                      ",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+                      unsigned(t + 1),
+                      double(int64_t(e.begin - profilerStartTicks)) / ticksPerUs,
+                      double(e.end - e.begin) / ticksPerUs);
+      first = false;
+    }
+
+    if (const uint64_t numDropped = profilerBuffer->getNumDropped()) {
+      reserve(kMaxEventLength);
+      out += snprintf(out,
+                      size_t(buffer.data() + buffer.size() - out),
+                      "%s\n{\"name\":\"minilog: %llu scopes dropped\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%u,\"ts\":0}",
+                      first ? "" : ",",
+                      (unsigned long long)numDropped,
+                      unsigned(t + 1));
+      first = false;
+    }
+  }
+
+  reserve(8);
+  out = copyString(out, buffer.data() + buffer.size(), "\n]}\n");
+  fwrite(buffer.data(), 1, size_t(out - buffer.data()), file);
+
+  return fclose(file) == 0;
 }
 
 bool minilog::callstackPushProc(const char* name) {
@@ -492,6 +6106,16 @@ bool minilog::callstackPushProc(const char* name) {
 
   ctx->procs[ctx->procsNestingLevel] = name;
   ctx->hasLogsOnThisLevel[ctx->procsNestingLevel] = false;
+
+  // procs which do not fit into the prefix are skipped
+  const uint32_t prefixLength = ctx->procsPrefixLength[ctx->procsNestingLevel];
+  const size_t nameLength = strlen(name);
+  const bool fits = nameLength <= kMaxProcsPrefixLength - prefixLength;
+  if (fits)
+    memcpy(ctx->procsPrefix + prefixLength, name, nameLength);
+  ctx->procsPrefixLength[ctx->procsNestingLevel + 1] = prefixLength + (fits ? uint32_t(nameLength) : 0);
+
+  ctx->procsBeginTicks[ctx->procsNestingLevel] = config.profiler ? getCurrentTicks() : 0;
   ctx->procsNestingLevel++;
 
   assert(ctx->procsNestingLevel < kMaxProcsNesting);
@@ -508,6 +6132,9 @@ void minilog::callstackPopProc() {
     log(Debug, "<-");
 
   ctx->procsNestingLevel--;
+
+  if (config.profiler && ctx->procsBeginTicks[ctx->procsNestingLevel])
+    addProfilerEvent(ctx, ctx->procs[ctx->procsNestingLevel], ctx->procsBeginTicks[ctx->procsNestingLevel], getCurrentTicks());
 }
 
 unsigned int minilog::callstackGetNumProcs() {
@@ -522,42 +6149,499 @@ const char* minilog::callstackGetProc(unsigned int i) {
   return ctx->procs[i];
 }
 
-bool minilog::callbackAdd(const LogCallback& cb) {
-  if (callbacksNum >= kMaxCallbacks)
+int minilog::sinkAdd(const SinkConfig& cfg) {
+  std::lock_guard<std::mutex> lock(logMutex);
+
+  Sink* sink = new Sink();
+
+  if (!sink->open(nextSinkId, cfg)) {
+    sink->close();
+    delete sink;
+    return -1;
+  }
+
+  sinks.push_back(sink);
+
+  updateEnabledLevels();
+
+  return nextSinkId++;
+}
+
+void minilog::sinkRemove(int sinkId) {
+  std::lock_guard<std::mutex> lock(logMutex);
+
+  for (size_t i = 0; i != sinks.size(); i++) {
+    if (sinks[i]->getId() == sinkId) {
+      sinks[i]->close();
+      delete sinks[i];
+      sinks.erase(sinks.begin() + i);
+      break;
+    }
+  }
+
+  updateEnabledLevels();
+}
+
+size_t minilog::sinkMemoryRead(int sinkId, char* buffer, size_t bufferSize) {
+  std::lock_guard<std::mutex> lock(logMutex);
+
+  for (const Sink* sink : sinks) {
+    if (sink->getId() == sinkId && sink->getConfig().type == Sink_Memory)
+      return sink->readMemory(buffer, bufferSize);
+  }
+
+  if (bufferSize)
+    *buffer = 0;
+
+  return 0;
+}
+
+minilog::Category* minilog::categoryGet(const char* name) {
+  std::lock_guard<std::mutex> lock(categoryMutex);
+
+  auto it = categories.find(name);
+
+  if (it != categories.end())
+    return it->second;
+
+  it = categories.emplace(name, nullptr).first;
+
+  const bool inherited = categoryDefaultLevel < 0;
+
+  it->second = new Category{it->first.c_str(), {inherited ? int(config.logLevel) : categoryDefaultLevel}, {inherited}};
+
+  return it->second;
+}
+
+void minilog::categorySetLevel(const char* name, eLogLevel level) {
+  if (strcmp(name, "*")) {
+    categorySetLevel(categoryGet(name), level);
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(categoryMutex);
+
+  categoryDefaultLevel = level;
+
+  for (const auto& c : categories)
+    categorySetLevel(c.second, level);
+}
+
+bool minilog::categoryLoadLevels(const char* fileName) {
+  FILE* f = fopen(fileName, "r");
+
+  if (!f)
     return false;
 
-  callbacks[callbacksNum++] = cb;
+  char line[256];
+
+  while (fgets(line, sizeof(line), f)) {
+    if (char* comment = strchr(line, '#'))
+      *comment = 0;
+
+    char* eq = strchr(line, '=');
+
+    if (!eq)
+      continue;
+
+    *eq = 0;
+
+    const char* name = trimWhitespace(line);
+    eLogLevel level;
+
+    if (*name && parseLogLevel(trimWhitespace(eq + 1), &level))
+      categorySetLevel(name, level);
+  }
+
+  fclose(f);
 
   return true;
 }
 
+void minilog::categoryRequestReload() {
+  categoryReloadRequested.store(true, std::memory_order_relaxed);
+}
+
+bool minilog::callbackAdd(const LogCallback& cb) {
+  return callbackRegistry.add(cb);
+}
+
 void minilog::callbackRemove(void* userData) {
-  for (uint32_t i = 0; i != callbacksNum; i++) {
-    if (callbacks[i].userData == userData) {
-      callbacks[i] = callbacks[callbacksNum - 1];
-      callbacksNum--;
-      return;
-    }
-  }
+  callbackRegistry.remove(userData);
 }
 
 minilog::CallstackScope::CallstackScope(const char* funcName, const char* format, ...) {
-  char argsBuf[kBufferSize];
+  char* const bufferEnd = buffer_ + kBufferSize - 1;
+
+  char* p = copyString(buffer_, bufferEnd, funcName);
+  p = copyString(p, bufferEnd, "(");
+
+  va_list args;
+  va_start(args, format);
+  const int length = vsnprintf(p, size_t(bufferEnd - p + 1), format, args);
+  va_end(args);
 
-  va_list p;
-  va_start(p, format);
-  vsnprintf(argsBuf, kBufferSize - 1, format, p);
-  va_end(p);
-  snprintf(buffer_, kBufferSize - 1, "%s(%s)->", funcName, argsBuf);
+  if (length > 0)
+    p = p + length < bufferEnd ? p + length : bufferEnd;
+  p = copyString(p, bufferEnd, ")->");
+  *p = 0;
 
   minilog::callstackPushProc(buffer_);
 }
 
 minilog::CallstackScope::CallstackScope(const char* funcName) {
+  const char* bufferEnd = buffer_ + kBufferSize - 1;
+
+  char* p = copyString(buffer_, bufferEnd, funcName);
 #if defined(__GNUC__) || defined(__clang__)
-  snprintf(buffer_, kBufferSize - 1, "%s->", funcName);
+  p = copyString(p, bufferEnd, "->");
 #else
-  snprintf(buffer_, kBufferSize - 1, "%s()->", funcName);
+  p = copyString(p, bufferEnd, "()->");
 #endif
+  *p = 0;
+
   minilog::callstackPushProc(buffer_);
 }
+
+bool minilog::decodeBinaryLog(const char* binaryFileName, const char* outFileName, const LogConfig& cfg) {
+  FILE* file = fopen(binaryFileName, "rb");
+
+  if (!file)
+    return false;
+
+  BinaryLogWriter::FileHeader header = {};
+
+  if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, BinaryLogWriter::kMagic, sizeof(header.magic)) ||
+      !header.version || header.version > BinaryLogWriter::kVersion || header.byteOrderMark != 0x01020304) {
+    fclose(file);
+    return false;
+  }
+
+  // the output has a LogFile of its own, the logger (which may be running) is never touched
+  LogConfig outCfg = cfg;
+  outCfg.binaryLog = false;
+  outCfg.rotateMaxFileSize = 0;
+  outCfg.rotateIntervalSec = 0;
+  outCfg.stats = false;
+  outCfg.timeStampPrecision = eTimeStampPrecision(header.timeStampPrecision);
+
+  LogFile outFile;
+
+  if (!outFile.open(outFileName, outCfg)) {
+    fclose(file);
+    return false;
+  }
+
+  // the binary log already contains the intro and the outro messages, only the HTML page is added
+  const bool html = outCfg.htmlLog && !outCfg.jsonLog;
+
+  if (html) {
+    const std::string intro = getHTMLIntro(outCfg.htmlPageTitle, outCfg.htmlPageHeader);
+    outFile.write(intro.data(), intro.size());
+  }
+
+  const char* mainThread = threadNameRegistry.intern(outCfg.mainThreadName);
+  std::vector<char> jsonLine;
+
+  struct ThreadEntry {
+    std::string name;
+    const char* internedName = nullptr;
+    uint64_t id = 0;
+  };
+
+  std::vector<std::string> formats;
+  std::vector<std::string> callstacks;
+  std::vector<ThreadEntry> threads;
+  std::vector<uint8_t> args;
+  std::vector<Field> fields;
+  std::vector<char> details;
+
+  auto readString = [file](std::vector<std::string>& table, uint32_t* id) -> bool {
+    uint32_t data[2];
+    if (fread(data, sizeof(data), 1, file) != 1)
+      return false;
+    std::string str(data[1], 0);
+    if (data[1] && fread(&str[0], 1, data[1], file) != data[1])
+      return false;
+    if (table.size() <= data[0])
+      table.resize(data[0] + 1);
+    table[data[0]] = std::move(str);
+    *id = data[0];
+    return true;
+  };
+
+  constexpr uint32_t kBufferLength = 8192;
+
+  // grows with the longest message, "%s" records hold the whole text
+  std::vector<char> text(kBufferLength);
+
+  bool ok = true;
+
+  for (int chunk = fgetc(file); chunk != EOF && ok; chunk = fgetc(file)) {
+    switch (chunk) {
+    case BinaryLogWriter::Chunk_Format: {
+      uint32_t id;
+      ok = readString(formats, &id);
+      break;
+    }
+    case BinaryLogWriter::Chunk_Callstack: {
+      uint32_t id;
+      ok = readString(callstacks, &id);
+      if (!ok)
+        break;
+      std::string& callstack = callstacks[id];
+      // before version 3 the callstack is the text, it becomes a single proc
+      if (header.version < 3)
+        callstack = callstack.empty() ? std::string(2, 0) : std::string(2, 0) + callstack + '\0';
+      // see writeCallstackData()
+      ok = callstack.size() >= 2 && !callstack.back();
+      break;
+    }
+    case BinaryLogWriter::Chunk_Thread: {
+      uint32_t data[2];
+      ThreadEntry t;
+      ok = fread(data, sizeof(data), 1, file) == 1 && fread(&t.id, sizeof(t.id), 1, file) == 1;
+      if (ok && data[1] != ~0u) {
+        t.name.resize(data[1]);
+        ok = !data[1] || fread(&t.name[0], 1, data[1], file) == data[1];
+        t.internedName = threadNameRegistry.intern(t.name.c_str());
+      }
+      if (ok) {
+        if (threads.size() <= data[0])
+          threads.resize(data[0] + 1);
+        threads[data[0]] = std::move(t);
+      }
+      break;
+    }
+    case BinaryLogWriter::Chunk_Message: {
+      BinaryLogWriter::MessageRecord rec;
+      ok = fread(&rec, sizeof(rec), 1, file) == 1 && rec.formatId < formats.size() && rec.callstackId < callstacks.size() &&
+           rec.threadIndex < threads.size() && rec.level <= FatalError;
+      if (!ok)
+        break;
+      uint32_t argsSize = rec.argsSize;
+      if (rec.flags & BinaryLogWriter::Flag_LongArgs)
+        ok = fread(&argsSize, sizeof(argsSize), 1, file) == 1;
+      args.resize(argsSize);
+      ok = ok && (!argsSize || fread(args.data(), 1, argsSize, file) == argsSize);
+      if (!ok)
+        break;
+
+      const std::string& callstack = callstacks[rec.callstackId];
+      const ThreadEntry& thread = threads[rec.threadIndex];
+
+      // the "%s" arguments of a structured message are followed by the fields
+      size_t formatArgsSize = args.size();
+      uint32_t numFields = 0;
+      fields.clear();
+      if (rec.flags & BinaryLogWriter::Flag_Structured) {
+        uint32_t length = 0;
+        if (args.size() >= sizeof(length))
+          memcpy(&length, args.data(), sizeof(length));
+        formatArgsSize = sizeof(length) + size_t(length) + 1;
+        ok = args.size() >= formatArgsSize + sizeof(numFields);
+        if (!ok)
+          break;
+        memcpy(&numFields, args.data() + formatArgsSize, sizeof(numFields));
+        const char* data = reinterpret_cast<const char*>(args.data()) + formatArgsSize + sizeof(numFields);
+        const char* dataEnd = reinterpret_cast<const char*>(args.data() + args.size());
+        for (uint32_t i = 0; i != numFields && ok; i++) {
+          Field f("", false);
+          data = readField(data, dataEnd, f);
+          ok = data != nullptr;
+          fields.push_back(f);
+        }
+        if (!ok)
+          break;
+      }
+
+      // field values are JSON-escaped in the text
+      if (text.size() < kBufferLength + callstack.size() + 6 * args.size())
+        text.resize(kBufferLength + callstack.size() + 6 * args.size());
+
+      char* buffer = text.data();
+      const char* bufferEnd = buffer + text.size() - 1;
+
+      // "[category] " and the callstack, see writeCurrentProcsNesting()
+      char* out = buffer;
+      if (!(rec.flags & BinaryLogWriter::Flag_Raw)) {
+        out = writeTimeStampAt(buffer, bufferEnd, rec.timeStamp, outCfg.timeStampPrecision);
+        const char* category = callstack.data() + 1;
+        const size_t categoryLength = strlen(category);
+        if (categoryLength) {
+          *out++ = '[';
+          memcpy(out, category, categoryLength);
+          out += categoryLength;
+          *out++ = ']';
+          *out++ = ' ';
+        }
+        if (callstack[0]) {
+          memcpy(out, "...", 3);
+          out += 3;
+        }
+        for (const char* proc = category + categoryLength + 1; proc < callstack.data() + callstack.size(); proc += strlen(proc) + 1)
+          out = copyString(out, bufferEnd, proc);
+      }
+      formatCapturedArgs(out, bufferEnd, formats[rec.formatId].c_str(), args.data(), args.data() + formatArgsSize);
+      const size_t msgLength = strlen(out);
+      writeFields(out, bufferEnd, fields.data(), fields.size());
+
+      // MessageDetails: the header, the callstack and the fields as they are in the file
+      const size_t fieldsSize = numFields ? args.size() - formatArgsSize - sizeof(numFields) : 0;
+      MessageDetails d;
+      d.size = uint32_t(sizeof(d) + callstack.size() + fieldsSize);
+      d.msgLength = numFields ? uint32_t(msgLength) : 0;
+      d.callstackSize = uint32_t(callstack.size());
+      d.numFields = numFields;
+      details.resize(d.size);
+      memcpy(details.data(), &d, sizeof(d));
+      memcpy(details.data() + sizeof(d), callstack.data(), callstack.size());
+      if (fieldsSize)
+        memcpy(details.data() + sizeof(d) + callstack.size(), args.data() + formatArgsSize + sizeof(numFields), fieldsSize);
+
+      LogMessage m;
+      m.level = eLogLevel(rec.level);
+      m.printToConsole = (rec.flags & BinaryLogWriter::Flag_PrintToConsole) != 0;
+      m.threadName = thread.internedName;
+      m.threadId = thread.id;
+      m.threadIndex = rec.threadIndex;
+      m.timeStamp = rec.timeStamp;
+      m.text = buffer;
+      m.msg = out;
+      m.details = details.data();
+      m.raw = (rec.flags & BinaryLogWriter::Flag_Raw) != 0;
+      m.categorized = (rec.flags & BinaryLogWriter::Flag_Categorized) != 0;
+      m.backtrace = (rec.flags & BinaryLogWriter::Flag_Backtrace) != 0;
+      m.structured = (rec.flags & BinaryLogWriter::Flag_Structured) != 0;
+
+      // see dispatchMessage()
+      if (!m.raw && !m.categorized && !m.backtrace && m.level < outCfg.logLevel)
+        break;
+
+      writeLogLine(outFile, m, outCfg, mainThread, jsonLine);
+      outFile.endMessage(m.level);
+
+      if (m.printToConsole && m.level >= outCfg.logLevelPrintToConsole) {
+        char threadId[24];
+        FilePart parts[kMaxLineParts];
+        const uint32_t numParts = getLineParts(m, false, outCfg.threadNames, mainThread, parts, threadId);
+        for (uint32_t i = 0; i != numParts; i++)
+          fwrite(parts[i].data, 1, parts[i].size, stdout);
+      }
+      break;
+    }
+    default:
+      ok = false;
+      break;
+    }
+  }
+
+  fclose(file);
+
+  if (html) {
+    const char* outro = getHTMLOutro(outCfg.htmlPageFooter);
+    outFile.write(outro, strlen(outro));
+  }
+
+  outFile.close();
+
+  return ok;
+}
+
+bool minilog::recoverLogFile(const char* fileName) {
+  FILE* file = fopen(fileName, "r+b");
+
+  if (!file)
+    return false;
+
+#if OS_WINDOWS
+  _fseeki64(file, 0, SEEK_END);
+  const int64_t fileSize = _ftelli64(file);
+#else
+  fseeko(file, 0, SEEK_END);
+  const int64_t fileSize = ftello(file);
+#endif // OS_WINDOWS
+
+  rewind(file);
+
+  BinaryLogWriter::FileHeader header = {};
+
+  const bool binary =
+      fread(&header, sizeof(header), 1, file) == 1 && !memcmp(header.magic, BinaryLogWriter::kMagic, sizeof(header.magic));
+
+  // the length of the file up to the last complete record
+  int64_t length = 0;
+
+  if (binary) {
+    // keep all complete chunks, the preallocated tail is zero-filled and 0 is not a valid chunk tag
+    int64_t pos = sizeof(header);
+    length = pos;
+    for (int chunk = fgetc(file); chunk != EOF; chunk = fgetc(file)) {
+      uint32_t data[2];
+      BinaryLogWriter::MessageRecord rec;
+      int64_t size = 0;
+      if (chunk == BinaryLogWriter::Chunk_Format || chunk == BinaryLogWriter::Chunk_Callstack) {
+        if (fread(data, sizeof(data), 1, file) != 1)
+          break;
+        size = 1 + sizeof(data) + data[1];
+      } else if (chunk == BinaryLogWriter::Chunk_Thread) {
+        if (fread(data, sizeof(data), 1, file) != 1)
+          break;
+        size = 1 + sizeof(data) + sizeof(uint64_t) + (data[1] != ~0u ? data[1] : 0);
+      } else if (chunk == BinaryLogWriter::Chunk_Message) {
+        if (fread(&rec, sizeof(rec), 1, file) != 1)
+          break;
+        uint32_t argsSize = rec.argsSize;
+        if ((rec.flags & BinaryLogWriter::Flag_LongArgs) && fread(&argsSize, sizeof(argsSize), 1, file) != 1)
+          break;
+        size = 1 + sizeof(rec) + ((rec.flags & BinaryLogWriter::Flag_LongArgs) ? sizeof(argsSize) : 0) + argsSize;
+      } else {
+        break;
+      }
+      if (pos + size > fileSize)
+        break;
+      pos += size;
+      length = pos;
+#if OS_WINDOWS
+      _fseeki64(file, pos, SEEK_SET);
+#else
+      fseeko(file, off_t(pos), SEEK_SET);
+#endif // OS_WINDOWS
+    }
+  } else {
+    // text and HTML logs: skip the zero-filled tail and a partially written last line
+    constexpr int64_t kBlockSize = 64 * 1024;
+    char block[kBlockSize];
+    bool hasData = false;
+    for (int64_t blockEnd = fileSize; blockEnd > 0 && !length;) {
+      const int64_t blockStart = blockEnd > kBlockSize ? blockEnd - kBlockSize : 0;
+#if OS_WINDOWS
+      _fseeki64(file, blockStart, SEEK_SET);
+#else
+      fseeko(file, off_t(blockStart), SEEK_SET);
+#endif // OS_WINDOWS
+      if (fread(block, 1, size_t(blockEnd - blockStart), file) != size_t(blockEnd - blockStart))
+        break;
+      for (int64_t i = blockEnd - blockStart - 1; i >= 0; i--) {
+        hasData = hasData || block[i];
+        if (hasData && block[i] == '\n') {
+          length = blockStart + i + 1;
+          break;
+        }
+      }
+      blockEnd = blockStart;
+    }
+  }
+
+  fflush(file);
+
+#if OS_WINDOWS
+  const bool ok = length == fileSize || !_chsize_s(_fileno(file), length);
+#else
+  const bool ok = length == fileSize || !ftruncate(fileno(file), off_t(length));
+#endif // OS_WINDOWS
+
+  fclose(file);
+
+  return ok;
+}
@@ -12,10 +12,54 @@
 #include <stdarg.h>
 #endif // MINILOG_ENABLE_VA_LIST
 
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <atomic>
+#include <initializer_list>
+#include <type_traits>
+
+// log levels below this one are compiled out of LLOG*() macros and logf() (0 - Paranoid, ..., 4 - FatalError)
+#if !defined(MINILOG_COMPILE_TIME_LEVEL)
+#define MINILOG_COMPILE_TIME_LEVEL 0
+#endif // MINILOG_COMPILE_TIME_LEVEL
+
 namespace minilog {
 
 enum eLogLevel { Paranoid = 0, Debug = 1, Log = 2, Warning = 3, FatalError = 4 };
 
+// what producers do when the async queue is full
+enum eQueueFullPolicy {
+  QueueFull_Block = 0, // wait until the writer thread frees a slot
+  QueueFull_DropNewest = 1, // drop the message being logged
+  QueueFull_DropOldest = 2, // drop the oldest queued message
+  QueueFull_DropLowPriority = 3, // drop Paranoid/Debug messages (new or queued) first, block for everything else
+};
+
+// how the default time stamp is written
+enum eTimeStampPrecision {
+  TimeStamp_Milliseconds = 0, // HH:MM:SS.mmm
+  TimeStamp_Microseconds = 1, // HH:MM:SS.uuuuuu
+  TimeStamp_Nanoseconds = 2, // HH:MM:SS.nnnnnnnnn
+  TimeStamp_Ticks = 3, // raw monotonic clock ticks, to be converted later
+};
+
+// how messages are written into the log file
+enum eFileBackend {
+  FileBackend_Stdio = 0, // buffered FILE* writes, see LogConfig::forceFlush
+  FileBackend_Batched = 1, // a large staging buffer submitted with a single writev() when full or on flush
+  FileBackend_Mapped = 2, // copy messages into a preallocated mmap()-ed file, see recoverLogFile() (POSIX only, Stdio on Windows)
+  FileBackend_IoUring = 3, // like Batched, but full buffers are written asynchronously through io_uring (Linux only, Batched elsewhere)
+};
+
+// how rotated log files are named, e.g. for "log.txt"
+enum eRotationNaming {
+  Rotation_Numbered = 0, // log.1.txt, log.2.txt, ...
+  Rotation_TimeStamped = 1, // log.20260101-120000.txt (local time when the segment was started)
+};
+
 // A user function to write a time stamp into a buffer `buffer`; it should not write past the pointer `bufferEnd`.
 // It returns a pointer to the end of the written data.
 using writeTimeStampFn = char* (*)(char* buffer, const char* bufferEnd);
@@ -24,20 +68,65 @@ struct LogConfig {
   eLogLevel logLevel = minilog::Debug; // everything >= this level goes to the log file
   eLogLevel logLevelPrintToConsole = minilog::Log; // everything >= this level is printed to the console (cannot be lower than logLevel)
   bool forceFlush = true; // call fflush() after every log() and logRaw()
+  eFileBackend fileBackend = FileBackend_Stdio;
+  unsigned int batchBufferSize = 256 * 1024; // FileBackend_Batched/IoUring: size of the staging buffer in bytes
+  unsigned int batchFlushIntervalMs = 100; // FileBackend_Batched/IoUring: staged messages are written out at least this often
+  eLogLevel batchFlushLevel = minilog::Warning; // FileBackend_Batched/IoUring: messages >= this level are written out immediately
+  unsigned int ioUringNumBuffers = 4; // FileBackend_IoUring: staging buffers of batchBufferSize bytes, the logging thread waits only when all are in flight
+  unsigned int durabilityIntervalMs = 0; // FileBackend_IoUring: fdatasync() is submitted at least this often (0 - never)
+  unsigned int mappedChunkSize = 16 * 1024 * 1024; // FileBackend_Mapped: the file is preallocated and remapped in chunks of this size
+  uint64_t rotateMaxFileSize = 0; // start a new log file once the current one reaches this size in bytes (0 - never)
+  unsigned int rotateIntervalSec = 0; // start a new log file at every multiple of this wall-clock interval (0 - never)
+  eRotationNaming rotateNaming = Rotation_Numbered; // rotated files are renamed, the current one is always `fileName`
+  unsigned int rotateMaxFiles = 0; // delete the oldest rotated files of this run beyond this number (0 - keep all)
+  bool rotateCompress = false; // compress rotated files into .lz4 on a background thread
+  bool asyncMode = false; // log() and logRaw() only format messages, a background writer thread outputs them
+  unsigned int asyncQueueCapacity = 4096; // number of 1 Kb message slots in the async queue (rounded up to a power of two)
+  eQueueFullPolicy asyncQueueFullPolicy = QueueFull_Block; // dropped messages are reported as warnings
+  bool callbackThread = false; // invoke callbacks on a separate dispatcher thread (uses asyncQueueCapacity and asyncQueueFullPolicy)
+  bool deferredFormatting = false; // asyncMode/threadBuffers: capture raw printf arguments, format them on the writer thread (format strings must outlive it)
+  bool threadBuffers = false; // stage messages in per-thread buffers without locking, a collector thread merges them by time stamp (not with asyncMode)
+  unsigned int threadBufferSize = 256 * 1024; // bytes per thread (rounded up to a power of two), asyncQueueFullPolicy applies when it is full (QueueFull_DropOldest acts as QueueFull_DropNewest)
+  unsigned int threadBufferFlushIntervalMs = 10; // the collector thread wakes up at least this often
+  unsigned int backtraceSize = 0; // keep the last N messages which no output wants in memory, per thread (0 - off)
+  eLogLevel backtraceTriggerLevel = minilog::FatalError; // messages >= this level write out the backtrace of their thread first
+  bool profiler = false; // time every callstackPushProc()/callstackPopProc() pair, see profilerExport()
+  const char* profilerFileName = nullptr; // deinitialize() exports the profile into this file
+  bool stats = false; // count messages, bytes, drops, waits and flushes, measure the latency of every call, see getStats()
+  unsigned int statsReportIntervalSec = 0; // stats: log a summary line this often (0 - never)
+  bool statsReportAtExit = false; // stats: deinitialize() logs a summary line
   bool writeIntro = true;
   bool writeOutro = true;
-  bool coloredConsole = true; // apply colors to console output (Windows, macOS, escape sequences)
+  bool coloredConsole = true; // apply colors to console output (Windows, macOS, escape sequences), only if stdout is a terminal
+  bool consoleThread = false; // write console output on a separate thread, a slow terminal does not stall logging
+  unsigned int consoleQueueSize = 1024 * 1024; // consoleThread: bytes of pending output, Paranoid/Debug are dropped when it is half full
   bool htmlLog = false; // output everything as HTML instead of plain text
+  bool jsonLog = false; // output JSON Lines instead of plain text or HTML, one object per message (see SinkFormat_JSON)
+  bool binaryLog = false; // write a compact binary log file instead of text/HTML, see decodeBinaryLog() and minilog_decode
   bool threadNames = true; // prefix log messages with thread names
+  unsigned int rateLimitPerSecond = 0; // messages per second from one call site (format string), the rest are dropped (0 - unlimited)
+  unsigned int rateLimitBurst = 0; // messages a call site may write at once (0 - rateLimitPerSecond)
+  bool coalesceDuplicates = false; // identical consecutive messages of a thread are collapsed into "last message repeated N times"
+  unsigned int suppressedReportIntervalMs = 1000; // how often messages dropped by the rate limit or coalesced are reported
+  unsigned int callstackMaxDepth = 0; // write only the deepest N procs of the callstack into messages, "..." marks the rest (0 - all)
   const char* htmlPageTitle = "Minilog"; // just the title of the resulting HTML page
   const char* htmlPageHeader = nullptr; // override default HTML header
   const char* htmlPageFooter = nullptr; // override default HTML footer
   const char* mainThreadName = "MainThread"; // just the name of the thread which calls minilog::initialize()
   writeTimeStampFn writeTimeStamp = nullptr; // override default time stamp function
+  eTimeStampPrecision timeStampPrecision = TimeStamp_Milliseconds; // default time stamp format
+  const char* categoryControlFile = nullptr; // category levels are reloaded from this file when it changes, see categoryLoadLevels()
+  unsigned int categoryControlFileIntervalMs = 1000; // how often the control file is checked for modifications
 };
 
 bool initialize(const char* fileName, const LogConfig& cfg); // non-thread-safe
-void deinitialize(); // non-thread-safe
+void deinitialize(); // non-thread-safe, in the async mode writes out all pending messages
+
+// convert a binary log file (LogConfig::binaryLog) into a text, HTML or JSON Lines log formatted according to `cfg`;
+// the logger is not affected, a running one keeps logging
+bool decodeBinaryLog(const char* binaryFileName, const char* outFileName, const LogConfig& cfg);
+// truncate a FileBackend_Mapped log file left behind by a crashed process to its last complete message
+bool recoverLogFile(const char* fileName); // non-thread-safe
 
 void log(eLogLevel level, const char* format, ...); // thread-safe
 void logRaw(eLogLevel level, const char* format, ...); // thread-safe
@@ -47,7 +136,7 @@ void logRaw(eLogLevel level, const char* format, va_list args); // thread-safe
 #endif // MINILOG_ENABLE_VA_LIST
 
 /// threads management
-void threadNameSet(const char* name); // thread-safe
+void threadNameSet(const char* name); // thread-safe, the name is copied into a global table of interned names
 const char* threadNameGet(); // thread-safe
 
 /// callstack management
@@ -56,14 +145,149 @@ void callstackPopProc(); // thread-safe
 unsigned int callstackGetNumProcs(); // thread-safe
 const char* callstackGetProc(unsigned int i); // thread-safe
 
+/// LogConfig::stats: what minilog itself costs, every counter is lock-free and sharded between threads
+struct Stats {
+  enum { kNumLatencyBuckets = 288 }; // 8 linear buckets per power of two nanoseconds, see getLatencyBucketNs()
+  unsigned long long numMessages[FatalError + 1] = {}; // everything submitted, minilog's own messages included
+  unsigned long long numBytesWritten = 0; // the log file and file sinks
+  unsigned long long numDropped = 0; // full queues: async ring, thread buffers, callback thread, console thread
+  unsigned long long numSuppressed = 0; // rate limit and coalesced duplicates
+  unsigned long long numFlushes = 0; // data handed over to the OS: fflush(), writev(), io_uring submissions
+  unsigned long long mutexWaitNs = 0; // logging threads waiting for the log mutex
+  unsigned long long queueWaitNs = 0; // logging threads waiting for free queue slots (QueueFull_Block)
+  unsigned long long latencyHistogram[kNumLatencyBuckets] = {}; // the latency of every log(), logf() and logRaw() call
+  unsigned long long latencyP50Ns = 0; // upper bounds of the histogram buckets
+  unsigned long long latencyP99Ns = 0;
+  unsigned long long latencyP999Ns = 0;
+  unsigned long long latencyMaxNs = 0;
+};
+Stats getStats(); // thread-safe, sums up all threads
+void resetStats(); // thread-safe, initialize() resets the stats as well
+unsigned long long getLatencyBucketNs(unsigned int bucket); // the lowest latency in a bucket of Stats::latencyHistogram
+
+/// LogConfig::profiler: Chrome Trace Event JSON with all scopes recorded so far (chrome://tracing, ui.perfetto.dev)
+bool profilerExport(const char* fileName); // thread-safe
+
 /// set up custom callbacks
 struct LogCallback {
   typedef void (*callback_t)(void*, const char*);
   callback_t funcs[minilog::FatalError + 1] = {};
   void* userData = nullptr;
 };
-bool callbackAdd(const LogCallback& cb); // non-thread-safe
-void callbackRemove(void* userData); // non-thread-safe
+bool callbackAdd(const LogCallback& cb); // thread-safe, never blocks logging threads
+void callbackRemove(void* userData); // thread-safe, returns when the callback is not running anywhere (except in the calling callback)
+
+/// additional outputs, each with its own level, format and flush policy
+enum eSinkType {
+  Sink_File = 0, // SinkConfig::fileName
+  Sink_Console = 1, // stdout, text is printed with colors just like LogConfig::logLevelPrintToConsole
+  Sink_Syslog = 2, // UDP datagrams to a syslog daemon (RFC 3164), localhost by default
+  Sink_Memory = 3, // a ring buffer in memory, see sinkMemoryRead()
+  Sink_User = 4, // SinkConfig::writeFn
+};
+
+enum eSinkFormat {
+  SinkFormat_Text = 0, // the lines of the text log file
+  SinkFormat_HTML = 1, // the lines of the HTML log file, the page header and footer are written when the sink is added and removed
+  SinkFormat_JSON = 2, // JSON Lines: {"level":..., "time":..., "thread":..., "category":..., "callstack":[...], "message":..., "fields":{...}}
+  SinkFormat_Binary = 3, // the binary log file (LogConfig::binaryLog), Sink_File only
+};
+
+using SinkWriteFn = void (*)(void* userData, eLogLevel level, const char* data, size_t size);
+using SinkFlushFn = void (*)(void* userData);
+
+struct SinkConfig {
+  eSinkType type = Sink_File;
+  eLogLevel minLevel = minilog::Debug; // everything >= this level goes to the sink (even below LogConfig::logLevel)
+  eSinkFormat format = SinkFormat_Text;
+  eLogLevel flushLevel = minilog::Warning; // flush the sink after messages >= this level
+  bool forceFlush = false; // flush the sink after every message
+  const char* fileName = nullptr; // Sink_File
+  eFileBackend fileBackend = FileBackend_Stdio; // Sink_File
+  const char* syslogHost = "127.0.0.1"; // Sink_Syslog: IPv4 address
+  unsigned short syslogPort = 514; // Sink_Syslog
+  const char* syslogTag = "minilog"; // Sink_Syslog
+  unsigned int memoryCapacity = 1024 * 1024; // Sink_Memory: bytes, the oldest messages are overwritten
+  SinkWriteFn writeFn = nullptr; // Sink_User: receives formatted messages
+  SinkFlushFn flushFn = nullptr; // Sink_User: optional
+  void* userData = nullptr; // Sink_User
+};
+
+int sinkAdd(const SinkConfig& cfg); // thread-safe, returns a sink id or -1, all sinks are removed by deinitialize()
+void sinkRemove(int sinkId); // thread-safe
+size_t sinkMemoryRead(int sinkId, char* buffer, size_t bufferSize); // thread-safe, copies the newest complete messages of a Sink_Memory sink
+
+/// categories (channels): named loggers with their own runtime levels, see LLOGC()
+struct Category {
+  const char* name;
+  std::atomic<int> level; // messages >= this level are logged (even below LogConfig::logLevel)
+  std::atomic<bool> inherited; // follows LogConfig::logLevel until a level is set explicitly
+};
+Category* categoryGet(const char* name); // thread-safe, the same pointer for the same name until the process exits
+void categorySetLevel(const char* name, eLogLevel level); // thread-safe, "*" sets all categories (including future ones)
+bool categoryLoadLevels(const char* fileName); // thread-safe, "name = level" lines applied in order, '#' starts a comment
+void categoryRequestReload(); // async-signal-safe, LogConfig::categoryControlFile is reloaded before the next message is written
+void log(Category* category, eLogLevel level, const char* format, ...); // thread-safe
+#if defined(MINILOG_ENABLE_VA_LIST)
+void log(Category* category, eLogLevel level, const char* format, va_list args); // thread-safe
+#endif // MINILOG_ENABLE_VA_LIST
+
+/// structured logging: typed key-value fields attached to a message, no intermediate strings are built
+///   minilog::log(minilog::Log, {{"status", 200}, {"path", path}, {"ms", 1.5}}, "request done");
+/// Text logs get the fields after a tab as `status=200 path="/index.html" ms=1.5`, JSON logs get them as "fields":{...}
+struct Field {
+  enum eType { Type_Signed, Type_Unsigned, Type_Double, Type_Bool, Type_String };
+
+  template <typename T, std::enable_if_t<std::is_integral_v<T> && std::is_signed_v<T>, int> = 0>
+  Field(const char* k, T v) : key(k), type(Type_Signed) {
+    value.i = v;
+  }
+  template <typename T, std::enable_if_t<std::is_integral_v<T> && std::is_unsigned_v<T> && !std::is_same_v<T, bool>, int> = 0>
+  Field(const char* k, T v) : key(k), type(Type_Unsigned) {
+    value.u = v;
+  }
+  template <typename T, std::enable_if_t<std::is_floating_point_v<T>, int> = 0>
+  Field(const char* k, T v) : key(k), type(Type_Double) {
+    value.d = double(v);
+  }
+  Field(const char* k, bool v) : key(k), type(Type_Bool) {
+    value.b = v;
+  }
+  Field(const char* k, const char* v) : key(k), type(Type_String) {
+    value.str.s = v ? v : "";
+    value.str.length = strlen(value.str.s);
+  }
+  // std::string, std::string_view and alike; the string has to outlive the log() call only
+  template <typename T,
+            std::enable_if_t<std::is_convertible_v<decltype(std::declval<const T&>().data()), const char*> &&
+                                 std::is_integral_v<decltype(std::declval<const T&>().size())>,
+                             int> = 0>
+  Field(const char* k, const T& v) : key(k), type(Type_String) {
+    value.str.s = v.data();
+    value.str.length = size_t(v.size());
+  }
+
+  const char* key; // written as is, should be a plain identifier
+  eType type;
+  union {
+    long long i;
+    unsigned long long u;
+    double d;
+    bool b;
+    struct {
+      const char* s;
+      size_t length;
+    } str;
+  } value;
+};
+void log(eLogLevel level, std::initializer_list<Field> fields, const char* format, ...); // thread-safe
+void log(Category* category, eLogLevel level, std::initializer_list<Field> fields, const char* format, ...); // thread-safe
+void logRaw(eLogLevel level, std::initializer_list<Field> fields, const char* format, ...); // thread-safe
+#if defined(MINILOG_ENABLE_VA_LIST)
+void log(eLogLevel level, std::initializer_list<Field> fields, const char* format, va_list args); // thread-safe
+void log(Category* category, eLogLevel level, std::initializer_list<Field> fields, const char* format, va_list args); // thread-safe
+void logRaw(eLogLevel level, std::initializer_list<Field> fields, const char* format, va_list args); // thread-safe
+#endif // MINILOG_ENABLE_VA_LIST
 
 /// RAII wrapper around callstackPushProc() and callstackPopProc()
 class CallstackScope {
@@ -82,6 +306,255 @@ class CallstackScope {
 
 unsigned int getCurrentMilliseconds();
 
+namespace detail {
+extern std::atomic<int> minEnabledLevel; // the lowest of LogConfig::logLevel and SinkConfig::minLevel of all sinks (Paranoid with a backtrace)
+} // namespace detail
+
+// the runtime check which helper macros do before evaluating any arguments
+inline bool isLogLevelEnabled(eLogLevel level) {
+  return level >= detail::minEnabledLevel.load(std::memory_order_relaxed);
+}
+
+inline bool isLogLevelEnabled(const Category* category, eLogLevel level) {
+  return level >= category->level.load(std::memory_order_relaxed);
+}
+
+// async-signal-safe
+inline void categorySetLevel(Category* category, eLogLevel level) {
+  category->inherited.store(false, std::memory_order_relaxed);
+  category->level.store(level, std::memory_order_relaxed);
+}
+
+/// type-safe logging: minilog::logf<minilog::Log>("x = {}, y = {}", x, y);
+/// Only "{}" placeholders are supported, "{{" and "}}" are escaped braces. With C++20 the number of placeholders
+/// is checked against the number of arguments at compile time; C++17 cannot check a function argument, there
+/// MINILOG_LOGF(minilog::Log, "x = {}, y = {}", x, y) does the same check for a string literal, logf() itself copies
+/// placeholders without arguments as is and ignores extra arguments. Messages go through the same pipeline as log().
+
+namespace detail {
+
+// log(level, "%s", msg) which copies `msg` instead of formatting it again, `site` is the logf() format string
+void logString(eLogLevel level, const char* site, const char* msg);
+
+template <typename T>
+struct TypeIdentity {
+  using type = T;
+};
+
+// returns the number of "{}" placeholders or -1 if the format string is malformed
+constexpr int countPlaceholders(const char* str) {
+  int n = 0;
+  for (; *str; str++) {
+    if (*str == '{') {
+      if (str[1] == '{')
+        str++;
+      else if (str[1] == '}')
+        str++, n++;
+      else
+        return -1;
+    } else if (*str == '}') {
+      if (str[1] != '}')
+        return -1;
+      str++;
+    }
+  }
+  return n;
+}
+
+// MINILOG_LOGF(): the number of arguments in an unevaluated context, they do not have to be constant expressions
+template <typename... Args>
+std::integral_constant<int, int(sizeof...(Args))> countArgs(const Args&...);
+
+// output buffer which starts on the stack and continues in a per-thread overflow buffer, never truncates
+class FormatBuffer {
+ public:
+  FormatBuffer(char* buffer, size_t size) : begin_(buffer), cur_(buffer), end_(buffer + size - 1) {}
+  ~FormatBuffer() {
+    if (overflow_)
+      release();
+  }
+  FormatBuffer(const FormatBuffer&) = delete;
+  FormatBuffer& operator=(const FormatBuffer&) = delete;
+  const char* c_str() {
+    *cur_ = 0;
+    return begin_;
+  }
+  void append(char c) {
+    if (cur_ == end_)
+      grow(1);
+    *cur_++ = c;
+  }
+  void append(const char* str, size_t length) {
+    if (length > size_t(end_ - cur_))
+      grow(length);
+    memcpy(cur_, str, length);
+    cur_ += length;
+  }
+  // copies literal text up to the next placeholder; returns false at the end of the format string
+  bool appendLiteral(const char*& str) {
+    for (; *str; str++) {
+      if (*str == '{' && str[1] == '}') {
+        str += 2;
+        return true;
+      }
+      if ((*str == '{' && str[1] == '{') || (*str == '}' && str[1] == '}'))
+        str++;
+      append(*str);
+    }
+    return false;
+  }
+  void appendUnsigned(unsigned long long v) {
+    char digits[20];
+    char* p = digits + sizeof(digits);
+    do {
+      *--p = char('0' + v % 10);
+      v /= 10;
+    } while (v);
+    append(p, size_t(digits + sizeof(digits) - p));
+  }
+
+ private:
+  // moves the text into a buffer with room for `length` more chars
+  void grow(size_t length);
+  void release();
+
+ private:
+  char* begin_;
+  char* cur_;
+  char* end_;
+  void* overflow_ = nullptr; // the OverflowArena of the calling thread or, if it is in use, one of our own
+  bool ownsOverflow_ = false;
+};
+
+template <typename T, typename Enable = void>
+struct Formatter {
+  static_assert(sizeof(T) == 0, "minilog::logf(): unsupported argument type");
+};
+
+template <>
+struct Formatter<bool> {
+  static void format(FormatBuffer& buf, bool v) {
+    v ? buf.append("true", 4) : buf.append("false", 5);
+  }
+};
+
+template <>
+struct Formatter<char> {
+  static void format(FormatBuffer& buf, char v) {
+    buf.append(v);
+  }
+};
+
+template <typename T>
+struct Formatter<T, std::enable_if_t<std::is_integral_v<T> && std::is_signed_v<T>>> {
+  static void format(FormatBuffer& buf, T v) {
+    if (v < 0) {
+      buf.append('-');
+      buf.appendUnsigned(0ull - (unsigned long long)v);
+    } else {
+      buf.appendUnsigned((unsigned long long)v);
+    }
+  }
+};
+
+template <typename T>
+struct Formatter<T, std::enable_if_t<std::is_integral_v<T> && std::is_unsigned_v<T>>> {
+  static void format(FormatBuffer& buf, T v) {
+    buf.appendUnsigned((unsigned long long)v);
+  }
+};
+
+template <typename T>
+struct Formatter<T, std::enable_if_t<std::is_enum_v<T>>> {
+  static void format(FormatBuffer& buf, T v) {
+    Formatter<std::underlying_type_t<T>>::format(buf, std::underlying_type_t<T>(v));
+  }
+};
+
+template <typename T>
+struct Formatter<T, std::enable_if_t<std::is_floating_point_v<T>>> {
+  static void format(FormatBuffer& buf, T v) {
+    char str[32];
+    const int n = snprintf(str, sizeof(str), "%g", double(v));
+    buf.append(str, n > 0 ? size_t(n) : 0);
+  }
+};
+
+template <>
+struct Formatter<const char*> {
+  static void format(FormatBuffer& buf, const char* v) {
+    v ? buf.append(v, strlen(v)) : buf.append("(null)", 6);
+  }
+};
+
+template <>
+struct Formatter<char*> : Formatter<const char*> {};
+
+// std::string, std::string_view and anything else with data() and size()
+template <typename T>
+struct Formatter<T, std::enable_if_t<std::is_convertible_v<decltype(std::declval<const T&>().data()), const char*> &&
+                                     std::is_integral_v<decltype(std::declval<const T&>().size())>>> {
+  static void format(FormatBuffer& buf, const T& v) {
+    buf.append(v.data(), size_t(v.size()));
+  }
+};
+
+template <typename T>
+struct Formatter<T*> {
+  static void format(FormatBuffer& buf, const T* v) {
+    char str[24];
+    const int n = snprintf(str, sizeof(str), "%p", (const void*)v);
+    buf.append(str, n > 0 ? size_t(n) : 0);
+  }
+};
+
+template <>
+struct Formatter<decltype(nullptr)> {
+  static void format(FormatBuffer& buf, decltype(nullptr)) {
+    buf.append("nullptr", 7);
+  }
+};
+
+template <typename T>
+inline void formatArg(FormatBuffer& buf, const char*& format, const T& arg) {
+  if (buf.appendLiteral(format))
+    Formatter<std::decay_t<T>>::format(buf, arg);
+}
+
+} // namespace detail
+
+template <typename... Args>
+struct FormatString {
+#if defined(__cpp_consteval)
+  template <size_t N>
+  consteval FormatString(const char (&s)[N]) : str(s) {
+    if (detail::countPlaceholders(s) != int(sizeof...(Args)))
+      throw "minilog::logf(): the number of {} placeholders does not match the number of arguments";
+  }
+#else
+  template <size_t N>
+  constexpr FormatString(const char (&s)[N]) : str(s) {}
+#endif // __cpp_consteval
+  const char* str;
+};
+
+template <eLogLevel Level, typename... Args>
+inline void logf(FormatString<typename detail::TypeIdentity<Args>::type...> format, const Args&... args) {
+  if constexpr (int(Level) >= MINILOG_COMPILE_TIME_LEVEL) {
+    if (!isLogLevelEnabled(Level))
+      return;
+
+    char buffer[512];
+    detail::FormatBuffer buf(buffer, sizeof(buffer));
+    const char* p = format.str;
+    (detail::formatArg(buf, p, args), ...);
+    // placeholders without arguments are copied as is
+    while (buf.appendLiteral(p))
+      buf.append("{}", 2);
+    detail::logString(Level, format.str, buf.c_str());
+  }
+}
+
 } // namespace minilog
 
 // clang-format off
@@ -93,18 +566,68 @@ unsigned int getCurrentMilliseconds();
 
 #if !defined(MINILOG_DISABLE_HELPER_MACROS)
 
+#if defined(MINILOG_RAW_OUTPUT)
+#	define MINILOG_LOG_IF(level, ...) MINILOG_LOG_PROC(level, __VA_ARGS__)
+#else
+#	define MINILOG_LOG_IF(level, ...) (minilog::isLogLevelEnabled(level) ? MINILOG_LOG_PROC(level, __VA_ARGS__) : (void)0)
+#endif // MINILOG_RAW_OUTPUT
+
+// the category is looked up once per call site, after that the check is a single relaxed load
+#if defined(MINILOG_RAW_OUTPUT)
+#	define LLOGC(category, level, ...) MINILOG_LOG_IF(level, __VA_ARGS__)
+#else
+#	define LLOGC(category, level, ...)                                                                      \
+		do {                                                                                                   \
+			if (int(level) >= MINILOG_COMPILE_TIME_LEVEL) {                                                      \
+				static minilog::Category* const minilogCategory = minilog::categoryGet(category);                   \
+				if (minilog::isLogLevelEnabled(minilogCategory, level))                                            \
+					minilog::log(minilogCategory, level, __VA_ARGS__);                                               \
+			}                                                                                                    \
+		} while (0)
+#endif // MINILOG_RAW_OUTPUT
+
+// logf() with the number of placeholders checked at compile time also in C++17, `format` has to be a string literal
+#define MINILOG_LOGF(level, format, ...)                                                                    \
+	do {                                                                                                      \
+		static_assert(minilog::detail::countPlaceholders(format) ==                                             \
+		                  decltype(minilog::detail::countArgs(__VA_ARGS__))::value,                             \
+		              "minilog::logf(): the number of {} placeholders does not match the number of arguments"); \
+		minilog::logf<level>(format, ##__VA_ARGS__);                                                            \
+	} while (0)
+
 #if defined(__GNUC__) && !defined(EMSCRIPTEN) && !defined(__clang__)
-#	define LLOGP(...) MINILOG_LOG_PROC(minilog::Paranoid, ##__VA_ARGS__)
-#	define LLOGD(...) MINILOG_LOG_PROC(minilog::Debug, ##__VA_ARGS__)
-#	define LLOGL(...) MINILOG_LOG_PROC(minilog::Log, ##__VA_ARGS__)
-#	define LLOGW(...) MINILOG_LOG_PROC(minilog::Warning, ##__VA_ARGS__)
-#	define LLOGE(...) MINILOG_LOG_PROC(minilog::FatalError, ##__VA_ARGS__)
+#	define LLOGP(...) MINILOG_LOG_IF(minilog::Paranoid, ##__VA_ARGS__)
+#	define LLOGD(...) MINILOG_LOG_IF(minilog::Debug, ##__VA_ARGS__)
+#	define LLOGL(...) MINILOG_LOG_IF(minilog::Log, ##__VA_ARGS__)
+#	define LLOGW(...) MINILOG_LOG_IF(minilog::Warning, ##__VA_ARGS__)
+#	define LLOGE(...) MINILOG_LOG_IF(minilog::FatalError, ##__VA_ARGS__)
 #else
-#	define LLOGP(...) MINILOG_LOG_PROC(minilog::Paranoid, ## __VA_ARGS__)
-#	define LLOGD(...) MINILOG_LOG_PROC(minilog::Debug, ## __VA_ARGS__)
-#	define LLOGL(...) MINILOG_LOG_PROC(minilog::Log, ## __VA_ARGS__)
-#	define LLOGW(...) MINILOG_LOG_PROC(minilog::Warning, ## __VA_ARGS__)
-#	define LLOGE(...) MINILOG_LOG_PROC(minilog::FatalError, ## __VA_ARGS__)
+#	define LLOGP(...) MINILOG_LOG_IF(minilog::Paranoid, ## __VA_ARGS__)
+#	define LLOGD(...) MINILOG_LOG_IF(minilog::Debug, ## __VA_ARGS__)
+#	define LLOGL(...) MINILOG_LOG_IF(minilog::Log, ## __VA_ARGS__)
+#	define LLOGW(...) MINILOG_LOG_IF(minilog::Warning, ## __VA_ARGS__)
+#	define LLOGE(...) MINILOG_LOG_IF(minilog::FatalError, ## __VA_ARGS__)
+#endif
+
+#if MINILOG_COMPILE_TIME_LEVEL > 0
+#	undef LLOGP
+#	define LLOGP(...) ((void)0)
+#endif
+#if MINILOG_COMPILE_TIME_LEVEL > 1
+#	undef LLOGD
+#	define LLOGD(...) ((void)0)
+#endif
+#if MINILOG_COMPILE_TIME_LEVEL > 2
+#	undef LLOGL
+#	define LLOGL(...) ((void)0)
+#endif
+#if MINILOG_COMPILE_TIME_LEVEL > 3
+#	undef LLOGW
+#	define LLOGW(...) ((void)0)
+#endif
+#if MINILOG_COMPILE_TIME_LEVEL > 4
+#	undef LLOGE
+#	define LLOGE(...) ((void)0)
 #endif
 
 #endif // MINILOG_DISABLE_HELPER_MACROS